@@ -0,0 +1,501 @@
+#include "async_io.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Direct I/O needs the buffer address, the offset and the size aligned
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// Largest single read/write request
+const size_t MAX_IO_CHUNK = size_t(1) << 30;
+
+// User data of the wake-up eventfd read, no request has this address
+const uint64_t WAKE_REQUEST = 1;
+
+// Helper functions
+
+std::runtime_error
+io_error(std::string message, std::string file_path)
+{
+    return std::runtime_error(message + " " + file_path + ": " + std::strerror(errno));
+}
+
+int
+open_for_writing(std::string file_path, bool direct_io)
+{
+    // Not every file system supports O_DIRECT, falling back to buffered writes then
+    int fd = -1;
+    if (direct_io)
+        fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0)
+        fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw io_error("Can't open output file", file_path);
+    return fd;
+}
+
+bool
+is_direct(int fd)
+{
+    return (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+}
+
+// io_uring
+
+struct AsyncIO::Ring
+{
+    int fd = -1;
+    unsigned entries = 0;
+
+    void * sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void * cq_ptr = nullptr;
+    size_t cq_size = 0;
+    io_uring_sqe * sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    io_uring_cqe * cqes;
+
+    // Buffer of the read of the wake-up eventfd
+    uint64_t wake_value = 0;
+
+    bool
+    setup(unsigned queue_depth)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+        if (fd < 0)
+            return false;
+
+        entries = params.sq_entries;
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            sq_ptr = nullptr;
+            return false;
+        }
+        if (single_mmap)
+            cq_ptr = sq_ptr;
+        else
+        {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+            {
+                cq_ptr = nullptr;
+                return false;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void * sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED)
+            return false;
+        sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+
+        auto sq = static_cast<char *>(sq_ptr);
+        auto cq = static_cast<char *>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        return supports(IORING_OP_READ) && supports(IORING_OP_WRITE);
+    }
+
+    bool
+    supports(uint8_t opcode)
+    {
+        // The kernels without the probe (before 5.6) lack the read and write opcodes too
+        std::vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    ~Ring()
+    {
+        if (sqes)
+            munmap(sqes, sqes_size);
+        if (cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr)
+            munmap(sq_ptr, sq_size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Adds an entry to the submission queue, false if it's full
+    bool
+    push(uint8_t opcode, int file, void * buffer, unsigned length, uint64_t offset, uint64_t user_data)
+    {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries)
+            return false;
+
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe & sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Entries pushed and not consumed by the kernel yet
+    unsigned
+    unsubmitted()
+    {
+        return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    // Takes the unsubmitted entries back, returning their user data
+    std::vector<uint64_t>
+    take_back()
+    {
+        std::vector<uint64_t> taken;
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        for (unsigned k = head; k != *sq_tail; ++k)
+            taken.push_back(sqes[sq_array[k & *sq_mask]].user_data);
+        __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+        return taken;
+    }
+};
+
+struct AsyncIO::Request
+{
+    std::string file_path;
+    int fd = -1;
+    bool write = false;
+
+    // The buffer being transferred, for direct writes an aligned copy padded
+    // to the alignment, the file is truncated to 'file_size' afterwards.
+    std::vector<uint8_t> data;
+    uint8_t * aligned_data = nullptr;
+    size_t size = 0;
+    size_t file_size = 0;
+    size_t done = 0;
+
+    std::promise<std::vector<uint8_t>> read_promise;
+    std::promise<void> write_promise;
+
+    uint8_t *
+    buffer()
+    {
+        return aligned_data ? aligned_data : data.data();
+    }
+
+    void
+    fail(std::exception_ptr error)
+    {
+        if (write)
+            write_promise.set_exception(error);
+        else
+            read_promise.set_exception(error);
+    }
+
+    void
+    finish()
+    {
+        if (write)
+            write_promise.set_value();
+        else
+            read_promise.set_value(std::move(data));
+    }
+
+    ~Request()
+    {
+        if (fd >= 0)
+            close(fd);
+        std::free(aligned_data);
+    }
+};
+
+// AsyncIO
+
+AsyncIO::AsyncIO(bool direct_io, unsigned queue_depth)
+: direct_io(direct_io)
+{
+    pool.reset(new ThreadPool(std::min(std::thread::hardware_concurrency(), 8u)));
+
+    // One entry of the ring is kept for the read of the wake-up eventfd
+    ring.reset(new Ring());
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd >= 0 && ring->setup(queue_depth) && ring->entries > 1)
+    {
+        max_in_flight = ring->entries - 1;
+        ring_thread = std::thread([this] { run_ring(); });
+    }
+    else
+    {
+        ring.reset();
+        if (wake_fd >= 0)
+            close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+AsyncIO::~AsyncIO()
+{
+    // The requests still being opened are queued first, then the ring thread
+    // finishes all the transfers
+    pool.reset();
+    if (ring)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        eventfd_write(wake_fd, 1);
+        ring_thread.join();
+        close(wake_fd);
+    }
+}
+
+bool
+AsyncIO::uses_io_uring()
+{
+    return ring != nullptr;
+}
+
+std::future<std::vector<uint8_t>>
+AsyncIO::read_file(std::string file_path)
+{
+    auto request = new Request();
+    request->file_path = file_path;
+    auto future = request->read_promise.get_future();
+
+    pool->submit([this, request] { start(request); });
+    return future;
+}
+
+std::future<void>
+AsyncIO::write_file(std::string file_path, std::vector<uint8_t> data)
+{
+    auto request = new Request();
+    request->file_path = file_path;
+    request->write = true;
+    request->data = std::move(data);
+    auto future = request->write_promise.get_future();
+
+    pool->submit([this, request] { start(request); });
+    return future;
+}
+
+void
+AsyncIO::start(Request * request)
+{
+    try
+    {
+        if (request->write)
+        {
+            request->fd = open_for_writing(request->file_path, direct_io);
+            request->size = request->file_size = request->data.size();
+            if (is_direct(request->fd))
+            {
+                request->size = (request->file_size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+                void * aligned = nullptr;
+                if (posix_memalign(&aligned, DIRECT_IO_ALIGNMENT, std::max(request->size, DIRECT_IO_ALIGNMENT)) != 0)
+                    throw std::runtime_error("Out of memory for " + request->file_path);
+                request->aligned_data = static_cast<uint8_t *>(aligned);
+                if (request->file_size > 0)
+                    std::memcpy(request->aligned_data, request->data.data(), request->file_size);
+                std::memset(request->aligned_data + request->file_size, 0, request->size - request->file_size);
+                std::vector<uint8_t>().swap(request->data);
+            }
+        }
+        else
+        {
+            struct stat file_stat;
+            request->fd = open(request->file_path.c_str(), O_RDONLY);
+            if (request->fd < 0 || fstat(request->fd, &file_stat) != 0)
+                throw io_error("Can't read file", request->file_path);
+            request->size = request->file_size = file_stat.st_size;
+            request->data.resize(request->size);
+        }
+    }
+    catch (...)
+    {
+        request->fail(std::current_exception());
+        delete request;
+        return;
+    }
+
+    if (request->size == 0)
+        complete(request, 0);
+    else if (ring)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queued.push_back(request);
+        }
+        eventfd_write(wake_fd, 1);
+    }
+    else
+        transfer(request);
+}
+
+void
+AsyncIO::transfer(Request * request)
+{
+    while (request->done < request->size)
+    {
+        size_t length = std::min(request->size - request->done, MAX_IO_CHUNK);
+        ssize_t result = request->write ?
+            pwrite(request->fd, request->buffer() + request->done, length, request->done) :
+            pread(request->fd, request->buffer() + request->done, length, request->done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            complete(request, result < 0 ? -errno : 0);
+            return;
+        }
+        request->done += result;
+    }
+    complete(request, 0);
+}
+
+void
+AsyncIO::complete(Request * request, int result)
+{
+    // 'result' is zero on success or a negative errno, short transfers are
+    // continued by the caller before.
+    if (result < 0 || request->done < request->size)
+    {
+        errno = (result < 0) ? -result : EIO;
+        request->fail(std::make_exception_ptr(io_error(
+            request->write ? "Can't write file" : "Can't read file", request->file_path)));
+    }
+    else if (request->write && request->aligned_data && ftruncate(request->fd, request->file_size) != 0)
+        request->fail(std::make_exception_ptr(io_error("Can't write file", request->file_path)));
+    else
+        request->finish();
+
+    delete request;
+}
+
+void
+AsyncIO::run_ring()
+{
+    // The only thread using the ring. A read of the wake-up eventfd stays in
+    // flight, new requests and the shutdown end the wait for completions.
+    std::deque<Request *> ready;
+    unsigned in_flight = 0;
+    bool wake_armed = false;
+    while (true)
+    {
+        bool stop;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            ready.insert(ready.end(), queued.begin(), queued.end());
+            queued.clear();
+            stop = stopping;
+        }
+        if (stop && ready.empty() && in_flight == 0)
+            return;
+
+        if (!wake_armed)
+            wake_armed = ring->push(IORING_OP_READ, wake_fd, &ring->wake_value, sizeof(ring->wake_value), 0, WAKE_REQUEST);
+        while (!ready.empty() && in_flight < max_in_flight)
+        {
+            auto request = ready.front();
+            size_t length = std::min(request->size - request->done, MAX_IO_CHUNK);
+            if (!ring->push(request->write ? IORING_OP_WRITE : IORING_OP_READ, request->fd,
+                            request->buffer() + request->done, length, request->done,
+                            reinterpret_cast<uint64_t>(request)))
+                break;
+            ready.pop_front();
+            ++in_flight;
+        }
+
+        // Submitting and waiting for a completion in one call. EAGAIN and EBUSY
+        // are transient (out of kernel memory, completions to reap first): the
+        // completions are reaped and the entries are submitted again next time.
+        // On other errors the entries are taken back and their requests fail.
+        if (syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted(), 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+            && errno != EINTR)
+        {
+            int error = errno;
+            if (error != EAGAIN && error != EBUSY)
+            {
+                for (auto user_data : ring->take_back())
+                {
+                    if (user_data == WAKE_REQUEST)
+                        wake_armed = false;
+                    else
+                    {
+                        complete(reinterpret_cast<Request *>(user_data), -error);
+                        --in_flight;
+                    }
+                }
+            }
+            if (*ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+            if (cqe.user_data == WAKE_REQUEST)
+            {
+                wake_armed = false;
+                continue;
+            }
+
+            // Short transfers are continued from where they stopped, before the new requests
+            auto request = reinterpret_cast<Request *>(cqe.user_data);
+            --in_flight;
+            if (cqe.res > 0)
+                request->done += cqe.res;
+            if (cqe.res > 0 && request->done < request->size)
+                ready.push_front(request);
+            else
+                complete(request, cqe.res < 0 ? cqe.res : 0);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Asynchronous whole-file reading and writing. The calls don't block: the files
+// are opened and their buffers prepared by a small pool of threads. The transfers
+// are then submitted to an io_uring instance when the kernel provides one with
+// the read and write operations, from a single thread owning the ring, otherwise
+// the pool threads execute them with blocking I/O. With 'direct_io' the written
+// files bypass the page cache (O_DIRECT), where the file system supports it.
+class AsyncIO
+{
+    public:
+
+    AsyncIO(bool direct_io = false, unsigned queue_depth = 64);
+    ~AsyncIO();
+
+    AsyncIO(const AsyncIO &) = delete;
+    AsyncIO & operator=(const AsyncIO &) = delete;
+
+    std::future<std::vector<uint8_t>>
+    read_file(std::string file_path);
+
+    std::future<void>
+    write_file(std::string file_path, std::vector<uint8_t> data);
+
+    bool
+    uses_io_uring();
+
+    private:
+
+    struct Ring;
+    struct Request;
+
+    // Opens the file of a request and prepares its buffer, on a pool thread
+    void
+    start(Request * request);
+
+    // Blocking transfer without the ring
+    void
+    transfer(Request * request);
+
+    void
+    complete(Request * request, int result);
+
+    // Loop of the ring thread
+    void
+    run_ring();
+
+    bool direct_io;
+    std::unique_ptr<Ring> ring;
+    std::unique_ptr<ThreadPool> pool;
+    std::thread ring_thread;
+
+    // Requests opened and waiting for the ring thread, which is woken through
+    // 'wake_fd'. The ring thread keeps at most 'max_in_flight' of them in flight,
+    // the others wait in its queue.
+    std::mutex queue_mutex;
+    std::deque<Request *> queued;
+    bool stopping = false;
+    int wake_fd = -1;
+    unsigned max_in_flight = 0;
+};
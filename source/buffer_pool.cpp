@@ -0,0 +1,163 @@
+#include "buffer_pool.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/mman.h>
+
+const size_t PAGE_SIZE = size_t(4) << 10;
+const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+BufferPool::BufferPool(bool huge_pages, size_t max_cached_bytes)
+: huge_pages(huge_pages), max_cached_bytes(max_cached_bytes)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+size_t
+BufferPool::bucket_size(size_t size) const
+{
+    // Sizes are rounded up so that slightly different requests share buffers
+    size_t granularity = (huge_pages && size >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    return (size + granularity - 1) / granularity * granularity;
+}
+
+void *
+BufferPool::allocate_buffer(size_t size) const
+{
+    if (huge_pages && size >= HUGE_PAGE_SIZE)
+    {
+        void * buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            throw std::bad_alloc();
+        madvise(buffer, size, MADV_HUGEPAGE);
+        return buffer;
+    }
+
+    return cv::fastMalloc(size);
+}
+
+void
+BufferPool::free_buffer(void * buffer, size_t size) const
+{
+    if (huge_pages && size >= HUGE_PAGE_SIZE)
+        munmap(buffer, size);
+    else
+        cv::fastFree(buffer);
+}
+
+cv::UMatData *
+BufferPool::allocate(int dims, const int * sizes, int type, void * data, size_t * step,
+                     cv::AccessFlag, cv::UMatUsageFlags) const
+{
+    // Same layout computation as the OpenCV standard allocator
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; --i)
+    {
+        if (step)
+        {
+            if (data && step[i] != CV_AUTOSTEP)
+                total = step[i];
+            else
+                step[i] = total;
+        }
+        total *= sizes[i];
+    }
+
+    auto u = new cv::UMatData(this);
+    if (data)
+    {
+        u->data = u->origdata = static_cast<uint8_t *>(data);
+        u->size = total;
+        u->flags |= cv::UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    size_t size = bucket_size(total);
+    void * buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto bucket = free_buffers.find(size);
+        if (bucket != free_buffers.end() && !bucket->second.empty())
+        {
+            buffer = bucket->second.back();
+            bucket->second.pop_back();
+            cached_bytes -= size;
+            ++reused;
+        }
+        else
+            ++allocated;
+    }
+    if (!buffer)
+        buffer = allocate_buffer(size);
+
+    u->data = u->origdata = static_cast<uint8_t *>(buffer);
+    u->size = size;
+    return u;
+}
+
+bool
+BufferPool::allocate(cv::UMatData * data, cv::AccessFlag, cv::UMatUsageFlags) const
+{
+    return data != nullptr;
+}
+
+void
+BufferPool::deallocate(cv::UMatData * u) const
+{
+    if (!u)
+        return;
+
+    if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+    {
+        bool cached = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cached_bytes + u->size <= max_cached_bytes)
+            {
+                free_buffers[u->size].push_back(u->origdata);
+                cached_bytes += u->size;
+                cached = true;
+            }
+        }
+        if (!cached)
+            free_buffer(u->origdata, u->size);
+        u->origdata = nullptr;
+    }
+
+    delete u;
+}
+
+void
+BufferPool::trim() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto & bucket : free_buffers)
+        for (auto buffer : bucket.second)
+            free_buffer(buffer, bucket.first);
+    free_buffers.clear();
+    cached_bytes = 0;
+}
+
+size_t
+BufferPool::reused_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return reused;
+}
+
+size_t
+BufferPool::allocated_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocated;
+}
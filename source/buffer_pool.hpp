@@ -0,0 +1,64 @@
+#pragma once
+
+#include "consts.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// OpenCV allocator recycling the released buffers. Installed as the default
+// allocator (cv::Mat::setDefaultAllocator) it keeps the layer, conversion and
+// accumulator buffers of a frame and hands them out again for the next frame,
+// so a batch of same-sized frames stops allocating after the first one.
+// At most 'max_cached_bytes' of released buffers are kept, the others are freed
+// (0 keeps none). With 'huge_pages' the large buffers are mapped with transparent
+// huge pages.
+// The pool must outlive every Mat allocated from it.
+class BufferPool : public cv::MatAllocator
+{
+    public:
+
+    BufferPool(bool huge_pages = false, size_t max_cached_bytes = BUFFER_POOL_MAX_CACHED_BYTES);
+    ~BufferPool();
+
+    cv::UMatData *
+    allocate(int dims, const int * sizes, int type, void * data, size_t * step,
+             cv::AccessFlag flags, cv::UMatUsageFlags usage_flags) const override;
+
+    bool
+    allocate(cv::UMatData * data, cv::AccessFlag flags, cv::UMatUsageFlags usage_flags) const override;
+
+    void
+    deallocate(cv::UMatData * data) const override;
+
+    // Frees all the cached buffers
+    void
+    trim() const;
+
+    // Allocations served from the cache / from the system since the creation
+    size_t reused_count() const;
+    size_t allocated_count() const;
+
+    private:
+
+    size_t
+    bucket_size(size_t size) const;
+
+    void *
+    allocate_buffer(size_t size) const;
+
+    void
+    free_buffer(void * buffer, size_t size) const;
+
+    bool huge_pages;
+    size_t max_cached_bytes;
+
+    mutable std::mutex mutex;
+    mutable std::map<size_t, std::vector<void *>> free_buffers;
+    mutable size_t cached_bytes = 0;
+    mutable size_t reused = 0;
+    mutable size_t allocated = 0;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <limits>
 
@@ -8,6 +9,34 @@ const float MAX_8_BIT_VALUE_F = static_cast<float>(MAX_8_BIT_VALUE);
 const uint16_t MAX_16_BIT_VALUE = std::numeric_limits<uint16_t>::max();
 const float MAX_16_BIT_VALUE_F = static_cast<float>(MAX_16_BIT_VALUE);
 
+// Side of the square tiles used for the per-layer depth bounds
+const int Z_TILE_SIZE = 64;
+
+// Layer index of the pixels without visible layers in the front layer AOV
+const uint16_t NO_LAYER = MAX_16_BIT_VALUE;
+
+// Largest layer count of a merge, the layer indices are 16-bit and NO_LAYER is reserved
+const size_t MAX_LAYERS = NO_LAYER;
+
+// Layers per pixel up to which the depth sort is an insertion sort instead of a radix sort
+const size_t INSERTION_SORT_LIMIT = 32;
+
+// Fewest decompressed tiles kept per thread for the compressed layers, a power of 2
+const size_t TILE_CACHE_SLOTS = 512;
+
+// Largest fraction of visible pixels of the layers stored as runs of visible pixels
+const float SPARSE_COVERAGE_LIMIT = 0.1f;
+
+// Bytes of released buffers the buffer pool keeps without a memory budget
+const size_t BUFFER_POOL_MAX_CACHED_BYTES = size_t(1) << 30;
+
+// Most digits of the zero padded width of a %0Nd frame token
+const size_t FRAME_TOKEN_MAX_DIGITS = 3;
+
+// Frames whose headers are read together by the manifest pre-flight, and the errors it reports
+const size_t PREFLIGHT_BATCH_FRAMES = 64;
+const size_t PREFLIGHT_MAX_ERRORS = 20;
+
 // GCC related
 #if !defined DBL_EPSILON
     const double DBL_EPSILON = std::numeric_limits<double>::epsilon();
@@ -0,0 +1,132 @@
+#include "dependency.hpp"
+#include "json11.hpp"
+#include "utilities.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Helper functions
+
+std::string
+record_path(const FrameEntry & frame)
+{
+    return frame.output_file_path + ".dep";
+}
+
+json11::Json
+file_record(const std::string & file_path, DependencyCheck check)
+{
+    // The 64-bit values are kept as strings, json numbers are doubles.
+    // A missing file gets an empty record, the merge reports it.
+    struct stat info;
+    if (stat(file_path.c_str(), &info) != 0)
+        return json11::Json::object{{"path", file_path}};
+
+    json11::Json::object record = {
+        {"path", file_path},
+        {"size", std::to_string(info.st_size)}};
+
+    if (check == DependencyCheck::HASH)
+    {
+        std::ifstream file(file_path, std::ios::binary);
+        std::vector<char> chunk(1 << 20);
+        uint64_t hash = 0;
+        while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0)
+            hash = hash_bytes(chunk.data(), file.gcount(), hash);
+        record["hash"] = std::to_string(hash);
+    }
+    else
+        record["mtime"] = std::to_string(info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec);
+
+    return record;
+}
+
+// Records
+
+json11::Json
+frame_record(const FrameEntry & frame, const json11::Json & parameters, DependencyCheck check)
+{
+    // The files of all the layers are checked in parallel
+    std::vector<json11::Json> layers(frame.layers.size());
+    #pragma omp parallel for
+    for (int k = 0; k < frame.layers.size(); ++k)
+    {
+        auto & layer = frame.layers[k];
+        json11::Json::object colour_aovs;
+        for (auto & aov : layer.colour_aov_file_paths)
+            colour_aovs[aov.first] = file_record(aov.second, check);
+        layers[k] = json11::Json::object{
+            {"I", file_record(layer.rgba_file_path, check)},
+            {"Z", file_record(layer.z_file_path, check)},
+            {"M", static_cast<int>(layer.mode)},
+            {"A", colour_aovs}};
+    }
+
+    return json11::Json::object{
+        {"output", frame.output_file_path},
+        {"parameters", parameters},
+        {"layers", layers}};
+}
+
+bool
+frame_up_to_date(const FrameEntry & frame, const json11::Json & record)
+{
+    std::ifstream file(record_path(frame));
+    if (!file)
+        return false;
+
+    std::string error;
+    auto saved = json11::Json::parse(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()), error);
+    if (!error.empty() || !saved["outputs"].is_array())
+        return false;
+
+    // Every produced file (pyramid levels, AOVs...) must still be there
+    struct stat info;
+    if (stat(frame.output_file_path.c_str(), &info) != 0)
+        return false;
+    for (auto & output : saved["outputs"].array_items())
+    {
+        if (stat(output.string_value().c_str(), &info) != 0)
+            return false;
+    }
+
+    auto inputs = saved.object_items();
+    inputs.erase("outputs");
+    return json11::Json(inputs) == record;
+}
+
+void
+remove_frame_record(const FrameEntry & frame)
+{
+    auto path = record_path(frame);
+    if (std::remove(path.c_str()) != 0 && errno != ENOENT)
+        throw std::runtime_error("Can't remove the dependency record " + path + ": " + std::strerror(errno));
+}
+
+void
+write_frame_record(const FrameEntry & frame, const json11::Json & record,
+                   const std::vector<std::string> & output_paths)
+{
+    auto saved = record.object_items();
+    saved["outputs"] = json11::Json(output_paths);
+
+    // Written aside and renamed, an interrupted run never leaves a valid partial record
+    auto path = record_path(frame);
+    auto temporary_path = path + ".tmp";
+    {
+        std::ofstream file(temporary_path);
+        file << json11::Json(saved).dump() << std::endl;
+        if (!file)
+            throw std::runtime_error("Can't write the dependency record " + temporary_path);
+    }
+    if (std::rename(temporary_path.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Can't write the dependency record " + path + ": " + std::strerror(errno));
+}
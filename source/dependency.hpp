@@ -0,0 +1,31 @@
+#pragma once
+
+#include "json11.hpp"
+#include "manifest.hpp"
+
+#include <string>
+#include <vector>
+
+// Dependency records of incremental runs. Once a frame is saved a record is
+// written next to its output as <output>.dep: the layer files with their sizes
+// and modification times (or content hashes), the merge parameters and all the
+// files the merge produced. A frame whose outputs all exist and whose record
+// still matches is up to date and is not merged again. The record of a frame is
+// removed before it is merged again, an interrupted merge leaves no record.
+
+enum class DependencyCheck {MTIME, HASH};
+
+json11::Json
+frame_record(const FrameEntry & frame, const json11::Json & parameters, DependencyCheck check);
+
+// True if the outputs listed in the saved record exist and the rest of it matches 'record'
+bool
+frame_up_to_date(const FrameEntry & frame, const json11::Json & record);
+
+void
+remove_frame_record(const FrameEntry & frame);
+
+// Saves 'record' with the paths of all the produced files
+void
+write_frame_record(const FrameEntry & frame, const json11::Json & record,
+                   const std::vector<std::string> & output_paths);
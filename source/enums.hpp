@@ -1,3 +1,5 @@
 #pragma once
 
 enum class BlendMode {NORMAL, MULTIPLY, SCREEN};
+
+enum class PixelStorage {NATIVE, UINT16, HALF};
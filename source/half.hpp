@@ -0,0 +1,37 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+// Conversions between float and half (cv::float16_t) pixels.
+// With F16C (-mf16c or -march=native) a whole 4-channel pixel is converted
+// by a single instruction, otherwise the OpenCV software conversion is used.
+
+#if defined(__F16C__)
+    #include <immintrin.h>
+#endif
+
+inline cv::Vec<float, 4>
+load_half4(const cv::float16_t * pixel)
+{
+    cv::Vec<float, 4> result;
+#if defined(__F16C__)
+    __m128i halfs = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixel));
+    _mm_storeu_ps(result.val, _mm_cvtph_ps(halfs));
+#else
+    for (int c = 0; c < 4; ++c)
+        result[c] = float(pixel[c]);
+#endif
+    return result;
+}
+
+inline void
+store_half4(const cv::Vec<float, 4> & value, cv::float16_t * pixel)
+{
+#if defined(__F16C__)
+    __m128i halfs = _mm_cvtps_ph(_mm_loadu_ps(value.val), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(pixel), halfs);
+#else
+    for (int c = 0; c < 4; ++c)
+        pixel[c] = cv::float16_t(value[c]);
+#endif
+}
@@ -0,0 +1,293 @@
+#include "manifest.hpp"
+#include "consts.hpp"
+#include "enums.hpp"
+#include "json11.hpp"
+#include "utilities.hpp"
+
+#include <cctype>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Helper functions
+
+std::string
+format_frame(std::string pattern, int frame_number)
+{
+    // The first '%' starting a token is replaced, the ones before it are plain
+    // characters of the path (e.g. "100%_grey/beauty.%04d.png")
+    for (auto start = pattern.find('%'); start != std::string::npos; start = pattern.find('%', start + 1))
+    {
+        auto end = start + 1;
+        while (end < pattern.size() && std::isdigit(pattern[end]))
+            ++end;
+        if (end >= pattern.size() || pattern[end] != 'd' || end - start > FRAME_TOKEN_MAX_DIGITS + 1)
+            continue;
+
+        auto number = std::to_string(frame_number);
+        size_t width = (end > start + 1) ? std::stoi(pattern.substr(start + 1, end - start - 1)) : 0;
+        if (number.size() < width)
+            number.insert(0, width - number.size(), '0');
+
+        return pattern.substr(0, start) + number + pattern.substr(end + 1);
+    }
+
+    return pattern;
+}
+
+int
+parse_int(const std::string & text)
+{
+    // The whole text must be the number, spaces around it aside
+    size_t end = 0;
+    int value = std::stoi(text, &end);
+    while (end < text.size() && std::isspace(text[end]))
+        ++end;
+    if (end != text.size())
+        throw std::invalid_argument(text);
+
+    return value;
+}
+
+// Frames
+
+std::vector<std::string>
+colour_aov_names(const FrameEntry & frame)
+{
+    std::set<std::string> names;
+    for (auto & layer : frame.layers)
+    {
+        for (auto & aov : layer.colour_aov_file_paths)
+            names.insert(aov.first);
+    }
+    return std::vector<std::string>(names.begin(), names.end());
+}
+
+// ManifestReader
+
+ManifestReader::ManifestReader(std::string json_file_path, std::string output_file_path)
+: json_file(json_file_path), json_file_path(json_file_path), output_file_path(output_file_path)
+{
+    if (!json_file)
+        throw std::runtime_error("Can't open the manifest " + json_file_path);
+}
+
+int
+ManifestReader::next_char()
+{
+    // Returns the next character skipping comment lines, -1 at the end of the file
+    while (line_position >= line.size())
+    {
+        if (!std::getline(json_file, line))
+            return -1;
+        ++line_number;
+        line_position = 0;
+        if (lstrip(line).substr(0, 2) == "//")
+            line.clear();
+    }
+
+    return line[line_position++];
+}
+
+std::runtime_error
+ManifestReader::entry_error(std::string message)
+{
+    return std::runtime_error("Manifest error! " + message + " (" + json_file_path + ", line " +
+                              std::to_string(entry_line) + ")");
+}
+
+bool
+ManifestReader::next_entry(json11::Json & entry)
+{
+    // Reads the next element of the top level array
+    int c = next_char();
+    while (c != -1 && std::isspace(c))
+        c = next_char();
+
+    if (!started)
+    {
+        if (c != '[')
+            throw std::runtime_error("Manifest error! " + json_file_path + " must contain a json array.");
+        started = true;
+        c = next_char();
+    }
+
+    while (c != -1 && (std::isspace(c) || c == ','))
+        c = next_char();
+    if (c == ']' || c == -1)
+    {
+        finished = true;
+        return false;
+    }
+    if (c != '{')
+        throw std::runtime_error("Manifest error! The entries of " + json_file_path + " must be json objects.");
+    entry_line = line_number;
+
+    // Collecting the text of the object, the braces inside strings don't count
+    std::string text;
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+    do
+    {
+        if (c == -1)
+            throw std::runtime_error("Manifest error! Unexpected end of " + json_file_path);
+        text += static_cast<char>(c);
+
+        if (in_string)
+        {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"')
+                in_string = false;
+        }
+        else if (c == '"')
+            in_string = true;
+        else if (c == '{' || c == '[')
+            ++depth;
+        else if (c == '}' || c == ']')
+            --depth;
+
+        if (depth > 0)
+            c = next_char();
+    }
+    while (depth > 0);
+
+    std::string error_message;
+    entry = json11::Json::parse(text, error_message);
+    if (!error_message.empty())
+        throw std::runtime_error("Manifest error! " + error_message);
+
+    return true;
+}
+
+LayerEntry
+ManifestReader::layer_entry(const json11::Json & entry, int frame_number)
+{
+    LayerEntry layer;
+    layer.rgba_file_path = format_frame(entry["I"].string_value(), frame_number);
+    layer.z_file_path = format_frame(entry["Z"].string_value(), frame_number);
+
+    layer.mode = blend_mode(entry["M"]);
+    for (auto & aov : entry["A"].object_items())
+        layer.colour_aov_file_paths[aov.first] = format_frame(aov.second.string_value(), frame_number);
+
+    return layer;
+}
+
+BlendMode
+ManifestReader::blend_mode(const json11::Json & mode)
+{
+    if (mode.is_null())
+        return BlendMode::NORMAL;
+
+    int value = -1;
+    if (mode.is_number() && mode.number_value() == mode.int_value())
+        value = mode.int_value();
+    else if (mode.is_string())
+    {
+        try
+        {
+            value = parse_int(mode.string_value());
+        }
+        catch (const std::logic_error &)
+        {
+        }
+    }
+
+    if (value < static_cast<int>(BlendMode::NORMAL) || value > static_cast<int>(BlendMode::SCREEN))
+        throw entry_error("Unknown blend mode " + mode.dump() + ", \"M\" must be 0 (normal), 1 (multiply) or 2 (screen).");
+
+    return static_cast<BlendMode>(value);
+}
+
+bool
+ManifestReader::next_frame(FrameEntry & frame)
+{
+    frame = FrameEntry();
+
+    // Continuing the frame entry being expanded
+    if (range_index < frame_ranges.size())
+    {
+        frame.number = frame_number;
+        auto & output = frame_entry["O"];
+        frame.output_file_path = format_frame(
+            output.is_string() ? output.string_value() : output_file_path, frame_number);
+        for (auto & layer : frame_entry["L"].array_items())
+            frame.layers.push_back(layer_entry(layer, frame_number));
+
+        auto & range = frame_ranges[range_index];
+        frame_number += range.step;
+        if ((range.step > 0) ? (frame_number > range.last) : (frame_number < range.last))
+        {
+            ++range_index;
+            if (range_index < frame_ranges.size())
+                frame_number = frame_ranges[range_index].first;
+        }
+        return true;
+    }
+
+    json11::Json entry;
+    if (finished || !next_entry(entry))
+        return false;
+
+    // A plain layer list, all the layers form the single frame
+    if (!entry["L"].is_array())
+    {
+        if (frame_entries)
+            throw entry_error("Layer and frame entries can't be mixed, a layer entry follows a frame entry.");
+
+        frame.output_file_path = output_file_path;
+        do
+        {
+            if (entry["L"].is_array())
+                throw entry_error("Layer and frame entries can't be mixed, a frame entry follows a layer entry.");
+            frame.layers.push_back(layer_entry(entry, 0));
+        }
+        while (next_entry(entry));
+        return true;
+    }
+
+    // A frame entry, the blend modes of its layers are checked before any frame is expanded
+    for (auto & layer : entry["L"].array_items())
+        blend_mode(layer["M"]);
+
+    // Parsing its frame ranges
+    frame_entries = true;
+    frame_entry = entry;
+    frame_ranges.clear();
+    range_index = 0;
+
+    std::string frames = entry["F"].is_number() ? std::to_string(entry["F"].int_value()) : entry["F"].string_value();
+    if (frames.empty())
+        frames = "0";
+    for (auto & item : split(frames))
+    {
+        int first, last, step;
+        try
+        {
+            auto step_position = item.find('x');
+            step = (step_position == std::string::npos) ? 1 : parse_int(item.substr(step_position + 1));
+            auto range = item.substr(0, step_position);
+
+            // The dash of a negative first frame is not a separator
+            auto dash = range.find('-', 1);
+            first = parse_int(range.substr(0, dash));
+            last = (dash == std::string::npos) ? first : parse_int(range.substr(dash + 1));
+        }
+        catch (const std::logic_error &)
+        {
+            throw entry_error("Invalid frame range \"" + item + "\"");
+        }
+        if (step <= 0)
+            throw entry_error("Invalid frame range \"" + item + "\", the step must be positive.");
+        frame_ranges.push_back({first, last, (last >= first) ? step : -step});
+    }
+    frame_number = frame_ranges[0].first;
+
+    return next_frame(frame);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "enums.hpp"
+#include "json11.hpp"
+
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Manifest layout. The manifest is a json array (lines starting with "//" are
+// comments) of either layer entries, which together form a single frame:
+//
+//     {"I": "beauty.png", "Z": "depth.png", "M": "0"}
+//
+// or frame entries, which list the layers of one or more frames. Paths may contain
+// a printf-like frame token (%d, %04d) replaced by every frame of "F", a frame
+// range like "1001-1100", "1001-1100x2" or "1,5,10-20". Without "O" the output
+// path given on the command line is used as the pattern:
+//
+//     {"F": "1001-1100", "O": "comp.%04d.png",
+//      "L": [{"I": "beauty.%04d.png", "Z": "depth.%04d.png", "M": "0"}, ...]}
+//
+// A manifest has either kind of entries, mixing them is an error.
+//
+// A layer may carry colour AOVs sharing its z-pass, each one is merged into
+// <output>_<name>.<ext> with the depth order of the layer colours:
+//
+//     {"I": "beauty.png", "Z": "depth.png", "M": "0",
+//      "A": {"diffuse": "diffuse.png", "specular": "specular.png"}}
+//
+// The manifest is read entry by entry and frame entries are expanded one frame
+// at a time, so the memory use does not depend on the manifest size.
+
+struct LayerEntry
+{
+    std::string rgba_file_path;
+    std::string z_file_path;
+    BlendMode mode = BlendMode::NORMAL;
+    // Colour AOV files by AOV name
+    std::map<std::string, std::string> colour_aov_file_paths;
+};
+
+struct FrameEntry
+{
+    int number = 0;
+    std::string output_file_path;
+    std::vector<LayerEntry> layers;
+};
+
+// Names of the colour AOVs of all the layers of the frame, sorted
+std::vector<std::string>
+colour_aov_names(const FrameEntry & frame);
+
+class ManifestReader
+{
+    public:
+
+    ManifestReader(std::string json_file_path, std::string output_file_path);
+
+    // Reads the next frame, returns false at the end of the manifest
+    bool
+    next_frame(FrameEntry & frame);
+
+    private:
+
+    struct FrameRange
+    {
+        int first;
+        int last;
+        int step;
+    };
+
+    bool
+    next_entry(json11::Json & entry);
+
+    int
+    next_char();
+
+    // Error about the last entry read
+    std::runtime_error
+    entry_error(std::string message);
+
+    LayerEntry
+    layer_entry(const json11::Json & entry, int frame_number);
+
+    // Blend mode of an "M" value, normal if there is none
+    BlendMode
+    blend_mode(const json11::Json & mode);
+
+    std::ifstream json_file;
+    std::string json_file_path;
+    std::string output_file_path;
+    std::string line;
+    size_t line_position = 0;
+    // Line of the file being read, and the one the last entry starts on
+    int line_number = 0;
+    int entry_line = 0;
+    bool started = false;
+    bool finished = false;
+    bool frame_entries = false;
+
+    // Frame entry being expanded
+    json11::Json frame_entry;
+    std::vector<FrameRange> frame_ranges;
+    size_t range_index = 0;
+    int frame_number = 0;
+};
+
+// Replaces the first %d / %0Nd frame token of 'pattern' with 'frame_number'
+std::string
+format_frame(std::string pattern, int frame_number);
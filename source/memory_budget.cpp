@@ -0,0 +1,135 @@
+#include "memory_budget.hpp"
+#include "utilities.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <string>
+
+// MemoryBudget
+
+MemoryBudget::MemoryBudget(size_t budget)
+: budget_bytes(budget)
+{
+}
+
+void
+MemoryBudget::acquire(size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] { return used == 0 || held + used + bytes <= budget_bytes; });
+    used += bytes;
+    peak_used = std::max(peak_used, held + used);
+}
+
+void
+MemoryBudget::release(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= std::min(used, bytes);
+    }
+    condition.notify_all();
+}
+
+void
+MemoryBudget::hold(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    held += bytes;
+    peak_used = std::max(peak_used, held + used);
+}
+
+void
+MemoryBudget::drop(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        held -= std::min(held, bytes);
+    }
+    condition.notify_all();
+}
+
+size_t
+MemoryBudget::budget()
+{
+    return budget_bytes;
+}
+
+size_t
+MemoryBudget::peak()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak_used;
+}
+
+// Helper functions
+
+LayerCost
+estimate_layer_cost(const ImageHeader & header, const std::vector<ImageHeader> & aov_headers,
+                    cv::Rect roi, PixelStorage storage)
+{
+    // Follows the ZImage constructor: both files are decoded whole, cropped to the
+    // roi and converted to the storage format, the z-pass is 16-bit grayscale.
+    LayerCost cost;
+    if (header.size.empty())
+        return cost;
+
+    size_t full_area = header.size.area();
+    size_t area = roi.empty() ? full_area : roi.area();
+    size_t pixel_size = header.channels * header.bytes_per_channel;
+
+    cost.decode = full_area * (pixel_size + 2);
+    if (!roi.empty())
+        cost.decode += area * (pixel_size + 2);
+
+    if (storage == PixelStorage::NATIVE)
+        cost.steady = area * (pixel_size + 2);
+    else
+    {
+        // The 4 channel copy at the decoded depth and the 16-bit (half or integer) one
+        cost.decode += area * 4 * header.bytes_per_channel;
+        cost.steady = area * (4 * 2 + 2);
+    }
+
+    // The colour AOVs are loaded the same way, without a z-pass
+    for (auto & aov_header : aov_headers)
+    {
+        size_t aov_pixel_size = aov_header.channels * aov_header.bytes_per_channel;
+        size_t aov_area = aov_header.size.area();
+        cost.decode += aov_area * aov_pixel_size;
+        cost.steady += (storage == PixelStorage::NATIVE) ? area * aov_pixel_size : area * 4 * 2;
+    }
+
+    return cost;
+}
+
+size_t
+parse_memory_size(std::string text)
+{
+    size_t position = 0;
+    double value = 0;
+    try
+    {
+        value = std::stod(text, &position);
+    }
+    catch (...)
+    {
+        return 0;
+    }
+    if (value <= 0)
+        return 0;
+
+    auto unit = (position < text.size()) ? std::toupper(text[position]) : 'B';
+    switch (unit)
+    {
+        case 'K': value *= 1024.0; break;
+        case 'M': value *= 1024.0 * 1024.0; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+        case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+        case 'B': break;
+        default: return 0;
+    }
+
+    return static_cast<size_t>(value);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "enums.hpp"
+#include "utilities.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Byte budget shared by the loading threads. acquire() blocks until the bytes fit
+// next to the ones in use and the held ones; a request larger than what is left
+// is let through once no other request is in use, so the loading always makes
+// progress. Held bytes (loaded layers, the merge result) count against the budget
+// until they are dropped, but never block that progress.
+class MemoryBudget
+{
+    public:
+
+    MemoryBudget(size_t budget);
+
+    void
+    acquire(size_t bytes);
+
+    void
+    release(size_t bytes);
+
+    void
+    hold(size_t bytes);
+
+    void
+    drop(size_t bytes);
+
+    size_t
+    budget();
+
+    // Largest amount of bytes in use so far
+    size_t
+    peak();
+
+    private:
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t budget_bytes;
+    size_t used = 0;
+    size_t held = 0;
+    size_t peak_used = 0;
+};
+
+// Estimated memory of a layer: the peak while it's decoded and converted, and
+// what stays in memory afterwards, from the headers of its colour file and of its
+// colour AOV files. Both are 0 if the headers can't tell.
+struct LayerCost
+{
+    size_t decode = 0;
+    size_t steady = 0;
+};
+
+LayerCost
+estimate_layer_cost(const ImageHeader & rgba_header, const std::vector<ImageHeader> & aov_headers,
+                    cv::Rect roi, PixelStorage storage);
+
+// Parses sizes like "512M", "8G" or "1073741824", returns 0 for invalid ones
+size_t
+parse_memory_size(std::string text);
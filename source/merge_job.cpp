@@ -0,0 +1,145 @@
+#include "merge_job.hpp"
+#include "preflight.hpp"
+#include "utilities.hpp"
+#include "zimage.hpp"
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <memory>
+#include <omp.h>
+#include <stdexcept>
+#include <thread>
+
+// MergeJob
+
+void
+MergeJob::cancel()
+{
+    *cancel_requested = true;
+}
+
+// MergeJobQueue
+
+MergeJobQueue::MergeJobQueue(unsigned concurrent_jobs)
+: threads_per_job(std::max(1, omp_get_num_procs() / static_cast<int>(std::max(concurrent_jobs, 1u)))),
+  pool(concurrent_jobs)
+{
+}
+
+MergeJob
+MergeJobQueue::submit(FrameEntry frame, MergeJobOptions options,
+                      JobProgress progress, JobCompletion completion)
+{
+    auto promise = std::make_shared<std::promise<void>>();
+    MergeJob job;
+    job.result = promise->get_future();
+    job.cancel_requested = std::make_shared<std::atomic<bool>>(false);
+
+    auto cancel_requested = job.cancel_requested;
+    pool.submit([this, frame, options, progress, completion, promise, cancel_requested]
+    {
+        // The OpenMP team size is a setting of the calling thread
+        omp_set_num_threads(threads_per_job);
+
+        std::exception_ptr error;
+        try
+        {
+            run(frame, options, progress, *cancel_requested);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        if (completion)
+            completion(error);
+        if (error)
+            promise->set_exception(error);
+        else
+            promise->set_value();
+    });
+
+    return job;
+}
+
+void
+MergeJobQueue::run(const FrameEntry & frame, const MergeJobOptions & options,
+                   const JobProgress & progress, std::atomic<bool> & cancel_requested)
+{
+    auto report = [&progress](JobStage stage, float fraction)
+    {
+        if (progress)
+            progress(stage, fraction);
+    };
+
+    int images_count = frame.layers.size();
+    if (images_count == 0)
+        throw std::runtime_error("No input images found for " + frame.output_file_path);
+
+    // The colour AOVs need the fan-out merge, which can't report its progress or be cancelled
+    if (!colour_aov_names(frame).empty())
+        throw std::runtime_error("Colour AOVs of " + frame.output_file_path + " can't be merged by a merge job.");
+
+    // A bad layer file fails the job from the headers, before any decoding
+    auto plan = plan_frame(frame, options.roi, options.storage);
+    if (!plan.errors.empty())
+        throw std::runtime_error(plan.errors[0]);
+
+    // Loading, the layers left after a cancellation are skipped
+    report(JobStage::LOADING, 0);
+    ZImageSet zimage_set(images_count);
+    zimage_set.half_accumulator = (options.storage == PixelStorage::HALF);
+    zimage_set.premultiplied = options.premultiplied;
+
+    // The first loading error fails the job
+    std::atomic<int> loaded(0);
+    std::vector<std::string> errors;
+    auto load_layer = [&](int k, cv::Rect load_roi)
+    {
+        if (cancel_requested)
+            return;
+
+        auto & layer = frame.layers[k];
+        zimage_set.z_images[k] = ZImage(layer.rgba_file_path, layer.z_file_path,
+                                        layer.mode, load_roi, options.storage);
+        int done = ++loaded;
+
+        #pragma omp critical(job_progress)
+        report(JobStage::LOADING, float(done) / images_count);
+    };
+    auto frame_size = [&]() { return plan.size.empty() ? image_size(frame.layers[0].rgba_file_path) : plan.size; };
+    auto merge_roi = zimage_set.load_layers(options.roi, options.expand_z, options.expand_radius,
+                                            frame_size, load_layer, errors);
+    if (!errors.empty())
+        throw std::runtime_error(errors[0]);
+    if (cancel_requested)
+        throw MergeCancelled();
+
+    if (!zimage_set.resolution_check())
+        throw std::runtime_error("Resolution error! Input images have different resolutions.");
+    if (options.expand_z)
+        zimage_set.expand_z(options.invert_z, options.expand_radius);
+    zimage_set.sparse_layers();
+
+    // Merging, the cancellation is checked between the bands of tile rows
+    zimage_set.progress = [&](float fraction)
+    {
+        report(JobStage::MERGING, fraction);
+        return !cancel_requested;
+    };
+    auto result = zimage_set.merge_images(options.invert_z, {0, 0, 0, 0}, merge_roi);
+    zimage_set.z_images.clear();
+
+    if (cancel_requested)
+        throw MergeCancelled();
+
+    report(JobStage::SAVING, 0);
+    if (!cv::imwrite(frame.output_file_path, result))
+        throw std::runtime_error("Can't save the output image " + frame.output_file_path);
+    report(JobStage::DONE, 1);
+}
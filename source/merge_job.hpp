@@ -0,0 +1,81 @@
+#pragma once
+
+#include "enums.hpp"
+#include "manifest.hpp"
+#include "thread_pool.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+
+// Asynchronous load + merge + save jobs for event driven hosts. The jobs are
+// queued on a shared pool of 'concurrent_jobs' threads and every running job
+// merges with its share of the cores (OpenMP threads), so any number of jobs can
+// be in flight without oversubscribing the machine.
+//
+// A job never blocks the caller: its future becomes ready when the output is
+// saved (or holds the error, MergeCancelled after a cancellation), and the
+// completion callback, if any, runs on the job thread right before, which is
+// the hook for resuming a coroutine or posting to an event loop.
+
+enum class JobStage {LOADING, MERGING, SAVING, DONE};
+
+struct MergeJobOptions
+{
+    bool invert_z = false;
+    bool expand_z = false;
+    // 0 grows the z-pass by a pixel, R > 0 by a (2R + 1) square
+    int expand_radius = 0;
+    cv::Rect roi;
+    PixelStorage storage = PixelStorage::NATIVE;
+    bool premultiplied = false;
+};
+
+// Called on the job thread with the stage and its completed fraction
+using JobProgress = std::function<void(JobStage, float)>;
+
+// Called on the job thread with the error of a failed job, nullptr on success
+using JobCompletion = std::function<void(std::exception_ptr)>;
+
+class MergeJob
+{
+    public:
+
+    std::future<void> result;
+
+    // Requests the cancellation, checked between the layers while loading and
+    // between the bands of tile rows while merging
+    void
+    cancel();
+
+    private:
+
+    friend class MergeJobQueue;
+
+    std::shared_ptr<std::atomic<bool>> cancel_requested;
+};
+
+class MergeJobQueue
+{
+    public:
+
+    MergeJobQueue(unsigned concurrent_jobs = 2);
+
+    MergeJob
+    submit(FrameEntry frame, MergeJobOptions options,
+           JobProgress progress = nullptr, JobCompletion completion = nullptr);
+
+    private:
+
+    void
+    run(const FrameEntry & frame, const MergeJobOptions & options,
+        const JobProgress & progress, std::atomic<bool> & cancel_requested);
+
+    int threads_per_job;
+
+    // Destroyed first, the pending jobs finish before the queue goes away
+    ThreadPool pool;
+};
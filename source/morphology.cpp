@@ -0,0 +1,79 @@
+#include "morphology.hpp"
+#include "consts.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <cstdint>
+
+// Helper functions
+
+inline void
+combine_rows(uint16_t * result, const uint16_t * a, const uint16_t * b, int cols, bool minimum)
+{
+    if (minimum)
+    {
+        #pragma omp simd
+        for (int j = 0; j < cols; ++j)
+            result[j] = std::min(a[j], b[j]);
+    }
+    else
+    {
+        #pragma omp simd
+        for (int j = 0; j < cols; ++j)
+            result[j] = std::max(a[j], b[j]);
+    }
+}
+
+void
+min_max_columns(cv::Mat & image, int radius, bool minimum)
+{
+    // The window of row y covers the rows y - radius .. y + radius. The rows are
+    // padded with the neutral value and cut in blocks of one window: 'prefix' is
+    // the running extremum from the start of a block, 'suffix' the one to its end,
+    // and the window starting at padded row k is combine(suffix[k], prefix[k + window - 1]).
+    int rows = image.rows;
+    int cols = image.cols;
+    int window = 2 * radius + 1;
+    int blocks = (rows + 2 * radius + window - 1) / window;
+    uint16_t neutral = minimum ? MAX_16_BIT_VALUE : 0;
+
+    cv::Mat prefix(blocks * window, cols, CV_16UC1, cv::Scalar(neutral));
+    image.copyTo(prefix(cv::Rect(0, radius, cols, rows)));
+    cv::Mat suffix(blocks * window, cols, CV_16UC1);
+
+    #pragma omp parallel for
+    for (int block = 0; block < blocks; ++block)
+    {
+        int first = block * window;
+        int last = first + window - 1;
+
+        prefix.row(last).copyTo(suffix.row(last));
+        for (int k = last - 1; k >= first; --k)
+            combine_rows(suffix.ptr<uint16_t>(k), suffix.ptr<uint16_t>(k + 1), prefix.ptr<uint16_t>(k), cols, minimum);
+
+        // In place, the suffix is done with the padded rows
+        for (int k = first + 1; k <= last; ++k)
+            combine_rows(prefix.ptr<uint16_t>(k), prefix.ptr<uint16_t>(k - 1), prefix.ptr<uint16_t>(k), cols, minimum);
+    }
+
+    #pragma omp parallel for
+    for (int y = 0; y < rows; ++y)
+        combine_rows(image.ptr<uint16_t>(y), suffix.ptr<uint16_t>(y), prefix.ptr<uint16_t>(y + window - 1), cols, minimum);
+}
+
+// Morphology
+
+void
+square_min_max(cv::Mat & image, int radius, bool minimum)
+{
+    if (radius <= 0 || image.empty())
+        return;
+
+    min_max_columns(image, radius, minimum);
+
+    cv::Mat transposed;
+    cv::transpose(image, transposed);
+    min_max_columns(transposed, radius, minimum);
+    cv::transpose(transposed, image);
+}
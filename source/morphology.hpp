@@ -0,0 +1,12 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+// Erodes ('minimum') or dilates the 16-bit single channel 'image' in place with
+// a (2 * radius + 1) square, as cv::erode/cv::dilate with the default border.
+// It is the separable van Herk/Gil-Werman filter: 3 comparisons per pixel and
+// pass whatever the radius. Both passes go over whole rows (the second one on the
+// transposed image), so the comparisons are vectorised and the rows are split
+// between the threads.
+void
+square_min_max(cv::Mat & image, int radius, bool minimum);
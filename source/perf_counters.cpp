@@ -0,0 +1,197 @@
+#include "perf_counters.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <omp.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+const char * COUNTER_NAMES[PerfCounters::COUNTERS_COUNT] = {
+    "cycles", "instructions", "LLC misses", "branch misses", "stalled cycles"};
+
+// Helper functions
+
+int
+open_counter(PerfCounters::Counter counter, pid_t thread_id)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch (counter)
+    {
+        case PerfCounters::CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PerfCounters::INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PerfCounters::LLC_MISSES: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case PerfCounters::BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        default: attr.config = PERF_COUNT_HW_STALLED_CYCLES_BACKEND; break;
+    }
+
+    return syscall(SYS_perf_event_open, &attr, thread_id, -1, -1, 0);
+}
+
+double
+read_counter(int fd)
+{
+    // The counters may be multiplexed, the count is scaled to the whole period
+    uint64_t values[3] = {};
+    if (fd < 0 || read(fd, values, sizeof(values)) != sizeof(values))
+        return -1;
+    if (values[2] == 0)
+        return 0;
+    return static_cast<double>(values[0]) * values[1] / values[2];
+}
+
+std::string
+format_value(double value)
+{
+    if (value < 0)
+        return "n/a";
+
+    std::ostringstream stream;
+    stream << std::fixed << std::setprecision(value < 1000 ? 2 : 0) << value;
+    return stream.str();
+}
+
+// PerfCounters
+
+PerfCounters::PerfCounters()
+{
+    // Every thread opens the counters of itself, the OpenMP threads are kept
+    // alive between the parallel regions.
+    fds.resize(omp_get_max_threads());
+    #pragma omp parallel
+    {
+        auto & thread_fds = fds[omp_get_thread_num()];
+        pid_t thread_id = syscall(SYS_gettid);
+        for (int c = 0; c < COUNTERS_COUNT; ++c)
+            thread_fds[c] = open_counter(static_cast<Counter>(c), thread_id);
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (auto & thread_fds : fds)
+    {
+        for (int fd : thread_fds)
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+}
+
+bool
+PerfCounters::available()
+{
+    for (auto & thread_fds : fds)
+    {
+        for (int fd : thread_fds)
+        {
+            if (fd >= 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+PerfCounters::Stage &
+PerfCounters::stage(std::string name)
+{
+    for (auto & stage : stages)
+    {
+        if (stage.name == name)
+            return stage;
+    }
+
+    stages.emplace_back();
+    stages.back().name = name;
+    stages.back().thread_values.resize(fds.size(), Values());
+    return stages.back();
+}
+
+void
+PerfCounters::begin(std::string stage)
+{
+    current_stage = stage;
+    for (auto & thread_fds : fds)
+    {
+        for (int fd : thread_fds)
+        {
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+}
+
+void
+PerfCounters::end(double megapixels)
+{
+    auto & current = stage(current_stage);
+    current.megapixels += megapixels;
+    for (size_t t = 0; t < fds.size(); ++t)
+    {
+        for (int c = 0; c < COUNTERS_COUNT; ++c)
+        {
+            int fd = fds[t][c];
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            // A counter which can't be read stays n/a for the stage
+            double value = read_counter(fd);
+            auto & total = current.thread_values[t][c];
+            total = (value < 0 || total < 0) ? -1 : total + value;
+        }
+    }
+}
+
+void
+PerfCounters::report()
+{
+    for (auto & stage : stages)
+    {
+        Values totals;
+        totals.fill(0);
+        for (auto & values : stage.thread_values)
+        {
+            for (int c = 0; c < COUNTERS_COUNT; ++c)
+                totals[c] = (values[c] < 0 || totals[c] < 0) ? -1 : totals[c] + values[c];
+        }
+
+        std::cout << "Perf counters of " << stage.name << " (" << stage.megapixels << " MP):" << std::endl;
+        for (int c = 0; c < COUNTERS_COUNT; ++c)
+        {
+            double per_megapixel = (totals[c] < 0 || stage.megapixels <= 0) ? -1 : totals[c] / stage.megapixels;
+            std::cout << "  " << std::left << std::setw(16) << COUNTER_NAMES[c] << std::right
+                      << " total " << format_value(totals[c]) << ", per MP " << format_value(per_megapixel);
+
+            // Per thread values, only the threads which ran the stage
+            std::cout << ", per thread";
+            for (auto & values : stage.thread_values)
+            {
+                if (values[CYCLES] != 0)
+                    std::cout << " " << format_value(values[c]);
+            }
+            std::cout << std::endl;
+        }
+        if (totals[CYCLES] > 0 && totals[INSTRUCTIONS] >= 0)
+            std::cout << "  instructions per cycle " << format_value(totals[INSTRUCTIONS] / totals[CYCLES]) << std::endl;
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hardware performance counters of the OpenMP threads, read with perf_event_open.
+// Every thread of the OpenMP team counts its own events; the counts are summed
+// per pipeline stage between begin() and end() over all the frames of a run.
+// Counters the machine (or the perf_event_paranoid setting) does not allow are
+// reported as n/a.
+class PerfCounters
+{
+    public:
+
+    enum Counter {CYCLES, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, STALLED_CYCLES, COUNTERS_COUNT};
+
+    using Values = std::array<double, COUNTERS_COUNT>;
+
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters & operator=(const PerfCounters &) = delete;
+
+    // True if at least one counter could be opened
+    bool
+    available();
+
+    void
+    begin(std::string stage);
+
+    // Ends the current stage, 'megapixels' is the frame size the stage worked on
+    void
+    end(double megapixels);
+
+    // Prints the totals of every stage, per megapixel and per thread
+    void
+    report();
+
+    private:
+
+    struct Stage
+    {
+        std::string name;
+        double megapixels = 0;
+        std::vector<Values> thread_values;
+    };
+
+    Stage &
+    stage(std::string name);
+
+    // fds[thread][counter], -1 for the counters which could not be opened
+    std::vector<std::array<int, COUNTERS_COUNT>> fds;
+    std::vector<Stage> stages;
+    std::string current_stage;
+};
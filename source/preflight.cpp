@@ -0,0 +1,213 @@
+#include "preflight.hpp"
+#include "consts.hpp"
+#include "utilities.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+// Helper functions
+
+// Headers and errors of a single layer
+struct LayerCheck
+{
+    ImageHeader rgba;
+    ImageHeader z;
+    LayerCost cost;
+    std::vector<std::string> errors;
+};
+
+ImageHeader
+check_file(const std::string & file_path, std::vector<std::string> & errors)
+{
+    if (access(file_path.c_str(), R_OK) != 0)
+    {
+        errors.push_back(file_path + ": Can't read the file!");
+        return ImageHeader();
+    }
+    return read_image_header(file_path);
+}
+
+void
+check_colour_header(const std::string & file_path, const ImageHeader & header, std::vector<std::string> & errors)
+{
+    if (header.channels == 0)
+        return;
+
+    if (header.bytes_per_channel != 1 && header.bytes_per_channel != 2 && header.bytes_per_channel != 4)
+        errors.push_back(file_path + ": Unsupported rgba-image format! Please use 8-bit, 16-bit or float image.");
+    if (header.channels != 3 && header.channels != 4)
+        errors.push_back(file_path + ": Unsupported rgba-image format! The image must have 3 (rgb) or 4 (rgba) channels.");
+}
+
+LayerCheck
+check_layer(const LayerEntry & layer, cv::Rect roi, PixelStorage storage)
+{
+    // An empty header (no PNG file) skips the checks, the decoding does them
+    LayerCheck check;
+    check.rgba = check_file(layer.rgba_file_path, check.errors);
+    check_colour_header(layer.rgba_file_path, check.rgba, check.errors);
+
+    check.z = check_file(layer.z_file_path, check.errors);
+    if (check.z.channels != 0 && check.z.channels != 1)
+        check.errors.push_back(layer.z_file_path + ": Unsupported depth-image format! Please use grayscale images.");
+    else if (check.z.channels != 0 && check.z.bytes_per_channel != 2)
+        check.errors.push_back(layer.z_file_path + ": Unsupported depth-image format! Please use 16-bit images.");
+
+    bool rgba_known = !check.rgba.size.empty();
+    if (rgba_known && !check.z.size.empty() && check.z.size != check.rgba.size)
+        check.errors.push_back(layer.z_file_path + ": Resolution error! The z-image must have the same resolution as " + layer.rgba_file_path);
+
+    std::vector<ImageHeader> aov_headers;
+    for (auto & aov : layer.colour_aov_file_paths)
+    {
+        auto header = check_file(aov.second, check.errors);
+        check_colour_header(aov.second, header, check.errors);
+        if (rgba_known && !header.size.empty() && header.size != check.rgba.size)
+            check.errors.push_back(aov.second + ": Resolution error! Colour AOVs must have the same resolution as " + layer.rgba_file_path);
+        aov_headers.push_back(header);
+    }
+
+    check.cost = estimate_layer_cost(check.rgba, aov_headers, roi, storage);
+    return check;
+}
+
+FramePlan
+frame_plan(const FrameEntry & frame, const std::vector<LayerCheck> & checks, cv::Rect roi)
+{
+    FramePlan plan;
+    for (size_t k = 0; k < checks.size(); ++k)
+    {
+        auto & check = checks[k];
+        plan.errors.insert(plan.errors.end(), check.errors.begin(), check.errors.end());
+        plan.costs.push_back(check.cost);
+        plan.steady += check.cost.steady;
+        plan.decode = std::max(plan.decode, check.cost.decode);
+
+        if (check.rgba.size.empty())
+            continue;
+        if (plan.size.empty())
+            plan.size = check.rgba.size;
+        else if (check.rgba.size != plan.size)
+            plan.errors.push_back(frame.layers[k].rgba_file_path + ": Resolution error! Input images of "
+                                  + frame.output_file_path + " have different resolutions.");
+    }
+
+    if (!plan.size.empty() && !roi.empty() && (roi & cv::Rect(cv::Point(0, 0), plan.size)) != roi)
+        plan.errors.push_back(frame.output_file_path + ": Region of interest is out of the image bounds!");
+
+    // The float accumulator and the 16-bit result are kept for the whole merge
+    size_t area = roi.empty() ? plan.size.area() : roi.area();
+    plan.result = area * (sizeof(cv::Vec<float, 4>) + sizeof(cv::Vec<uint16_t, 4>));
+    plan.steady += plan.result;
+
+    return plan;
+}
+
+// Plans
+
+FramePlan
+plan_frame(const FrameEntry & frame, cv::Rect roi, PixelStorage storage)
+{
+    std::vector<LayerCheck> checks(frame.layers.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < checks.size(); ++k)
+        checks[k] = check_layer(frame.layers[k], roi, storage);
+
+    return frame_plan(frame, checks, roi);
+}
+
+FramePlan
+estimate_frame(const FrameEntry & frame, cv::Rect roi, PixelStorage storage)
+{
+    std::vector<LayerCheck> checks(frame.layers.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < checks.size(); ++k)
+    {
+        auto & layer = frame.layers[k];
+        std::vector<ImageHeader> aov_headers;
+        for (auto & aov : layer.colour_aov_file_paths)
+            aov_headers.push_back(read_image_header(aov.second));
+        checks[k].rgba = read_image_header(layer.rgba_file_path);
+        checks[k].cost = estimate_layer_cost(checks[k].rgba, aov_headers, roi, storage);
+    }
+
+    // The resolution and roi checks of frame_plan are dropped as well
+    auto plan = frame_plan(frame, checks, roi);
+    plan.errors.clear();
+    return plan;
+}
+
+ManifestPlan
+plan_manifest(std::string json_file_path, std::string output_file_path, cv::Rect roi, PixelStorage storage)
+{
+    ManifestPlan manifest_plan;
+    ManifestReader manifest(json_file_path, output_file_path);
+    FrameEntry frame;
+    bool more = true;
+
+    // A manifest error ends the reading, the frames before it are still checked
+    auto next_frame = [&]()
+    {
+        try
+        {
+            return manifest.next_frame(frame);
+        }
+        catch (const std::exception & error)
+        {
+            if (manifest_plan.error_count++ < PREFLIGHT_MAX_ERRORS)
+                manifest_plan.errors.push_back(error.what());
+            return false;
+        }
+    };
+
+    while (more)
+    {
+        // The layers of a whole batch are checked at once, short frames keep all the threads busy
+        std::vector<FrameEntry> frames;
+        while (frames.size() < PREFLIGHT_BATCH_FRAMES && (more = next_frame()))
+        {
+            if (!frame.layers.empty())
+                frames.push_back(frame);
+        }
+
+        std::vector<std::pair<size_t, size_t>> layers;
+        std::vector<std::vector<LayerCheck>> checks(frames.size());
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            checks[f].resize(frames[f].layers.size());
+            for (size_t k = 0; k < frames[f].layers.size(); ++k)
+                layers.emplace_back(f, k);
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int n = 0; n < layers.size(); ++n)
+        {
+            auto f = layers[n].first;
+            auto k = layers[n].second;
+            checks[f][k] = check_layer(frames[f].layers[k], roi, storage);
+        }
+
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            auto plan = frame_plan(frames[f], checks[f], roi);
+            ++manifest_plan.frames;
+            manifest_plan.layers += frames[f].layers.size();
+            manifest_plan.max_steady = std::max(manifest_plan.max_steady, plan.steady);
+            manifest_plan.max_decode = std::max(manifest_plan.max_decode, plan.decode);
+            for (auto & error : plan.errors)
+            {
+                if (manifest_plan.error_count++ < PREFLIGHT_MAX_ERRORS)
+                    manifest_plan.errors.push_back(error);
+            }
+        }
+    }
+
+    return manifest_plan;
+}
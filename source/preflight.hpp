@@ -0,0 +1,56 @@
+#pragma once
+
+#include "enums.hpp"
+#include "manifest.hpp"
+#include "memory_budget.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Pre-flight checks from the image file headers alone, so a bad manifest fails
+// before anything is decoded. Every file must be readable, and the PNG headers
+// must match what the merge accepts: 8 or 16-bit colours and colour AOVs with
+// 3 or 4 channels, 16-bit grayscale z-passes, and a single resolution per frame that holds the
+// region of interest. The headers of other formats aren't read, those files are
+// only checked when they are decoded.
+
+// What a frame needs, known before its layers are loaded
+struct FramePlan
+{
+    // Resolution of the layers, empty if no header could be read
+    cv::Size size;
+    std::vector<LayerCost> costs;
+    // Bytes of the merge buffers, and of them with the loaded layers
+    size_t result = 0;
+    size_t steady = 0;
+    // Largest transient bytes of a layer decode
+    size_t decode = 0;
+    std::vector<std::string> errors;
+};
+
+// The layer headers are read in parallel
+FramePlan
+plan_frame(const FrameEntry & frame, cv::Rect roi, PixelStorage storage);
+
+// The same plan without any check, the errors stay empty
+FramePlan
+estimate_frame(const FrameEntry & frame, cv::Rect roi, PixelStorage storage);
+
+// Pre-flight of all the frames of a manifest, the errors beyond the first
+// PREFLIGHT_MAX_ERRORS are only counted
+struct ManifestPlan
+{
+    int frames = 0;
+    int layers = 0;
+    size_t max_steady = 0;
+    size_t max_decode = 0;
+    size_t error_count = 0;
+    std::vector<std::string> errors;
+};
+
+// The manifest is read again here, batches of frames have their headers read in parallel
+ManifestPlan
+plan_manifest(std::string json_file_path, std::string output_file_path, cv::Rect roi, PixelStorage storage);
@@ -0,0 +1,87 @@
+#include "pyramid.hpp"
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <numeric>
+#include <omp.h>
+#include <vector>
+
+cv::Mat_<cv::Vec<uint16_t, 4>>
+downsample_half(const cv::Mat_<cv::Vec<uint16_t, 4>> & image)
+{
+    int height = (image.rows + 1) / 2;
+    int width = (image.cols + 1) / 2;
+    cv::Mat_<cv::Vec<uint16_t, 4>> result(height, width);
+
+    #pragma omp parallel for
+    for (int i = 0; i < height; ++i)
+    {
+        const cv::Vec<uint16_t, 4> * row_0 = image[2 * i];
+        const cv::Vec<uint16_t, 4> * row_1 = image[std::min(2 * i + 1, image.rows - 1)];
+        cv::Vec<uint16_t, 4> * result_row = result[i];
+
+        for (int j = 0; j < width; ++j)
+        {
+            int j_0 = 2 * j;
+            int j_1 = std::min(2 * j + 1, image.cols - 1);
+            for (int c = 0; c < 4; ++c)
+            {
+                uint32_t sum = uint32_t(row_0[j_0][c]) + row_0[j_1][c] + row_1[j_0][c] + row_1[j_1][c];
+                result_row[j][c] = static_cast<uint16_t>((sum + 2) / 4);
+            }
+        }
+    }
+
+    return result;
+}
+
+std::vector<cv::Size>
+pyramid_sizes(cv::Size size, int levels)
+{
+    std::vector<cv::Size> sizes;
+    for (int level = 0; level < levels; ++level)
+    {
+        size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+        sizes.push_back(size);
+    }
+
+    return sizes;
+}
+
+std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>>
+build_pyramid(const cv::Mat_<cv::Vec<uint16_t, 4>> & image, std::vector<cv::Size> sizes)
+{
+    std::vector<size_t> order(sizes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&sizes](size_t a, size_t b) { return sizes[a].area() > sizes[b].area(); });
+
+    std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>> levels(sizes.size());
+    cv::Mat_<cv::Vec<uint16_t, 4>> previous = image;
+    for (auto k : order)
+    {
+        auto size = sizes[k];
+        cv::Size half((previous.cols + 1) / 2, (previous.rows + 1) / 2);
+
+        // Levels larger than the previous one can not be derived from it
+        bool from_previous = (size.width <= previous.cols && size.height <= previous.rows);
+        const cv::Mat_<cv::Vec<uint16_t, 4>> & source = from_previous ? previous : image;
+
+        // Area averaging for any downscale, cubic only when a side grows
+        bool downscale = (size.width <= source.cols && size.height <= source.rows);
+        if (size == source.size())
+            levels[k] = source.clone();
+        else if (size == half && from_previous)
+            levels[k] = downsample_half(source);
+        else
+            cv::resize(source, levels[k], size, 0, 0, downscale ? cv::INTER_AREA : cv::INTER_CUBIC);
+
+        // An interpolated level would blur the smaller ones, they are derived from the image instead
+        if (size.width <= image.cols && size.height <= image.rows)
+            previous = levels[k];
+    }
+
+    return levels;
+}
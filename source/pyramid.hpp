@@ -0,0 +1,22 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+// Halves the image in both directions with a 2x2 box filter,
+// odd sizes are rounded up by repeating the last row/column.
+cv::Mat_<cv::Vec<uint16_t, 4>>
+downsample_half(const cv::Mat_<cv::Vec<uint16_t, 4>> & image);
+
+// Sizes of 'levels' successive halvings of 'size'.
+std::vector<cv::Size>
+pyramid_sizes(cv::Size size, int levels);
+
+// Resamples the image to every size in 'sizes' (results are in the same order).
+// Levels are computed from the largest to the smallest one, each from the
+// previous downscaled level, so every step only reads an image that is already
+// small. Downscales average the pixel areas, the sizes larger than the image in
+// either direction are interpolated from it (bicubic) and never used as a source.
+std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>>
+build_pyramid(const cv::Mat_<cv::Vec<uint16_t, 4>> & image, std::vector<cv::Size> sizes);
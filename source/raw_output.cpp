@@ -0,0 +1,89 @@
+#include "raw_output.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// RawImage
+
+RawImage::RawImage(std::string path, RawOutputMode mode, cv::Size size, int type)
+{
+    size_t row_bytes = size.width * CV_ELEM_SIZE(type);
+    size_t data_size = row_bytes * size.height;
+    mapping_size = sizeof(RawImageHeader) + data_size;
+
+    int fd = -1;
+    if (mode == RawOutputMode::SHARED_MEMORY)
+    {
+        auto slash = path.find_last_of('/');
+        name = "/" + ((slash == std::string::npos) ? path : path.substr(slash + 1));
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    else
+    {
+        name = path;
+        unlink(name.c_str());
+        fd = open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0)
+        throw std::runtime_error("Can't create the raw output " + name + ": " + std::strerror(errno));
+
+    if (ftruncate(fd, mapping_size) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Can't allocate the raw output " + name + ": " + std::strerror(errno));
+    }
+    mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Can't map the raw output " + name + ": " + std::strerror(errno));
+
+    auto header = static_cast<RawImageHeader *>(mapping);
+    std::memcpy(header->magic, RAW_IMAGE_MAGIC, sizeof(header->magic));
+    header->version = RAW_IMAGE_VERSION;
+    header->header_size = sizeof(RawImageHeader);
+    header->width = size.width;
+    header->height = size.height;
+    header->type = type;
+    header->channels = CV_MAT_CN(type);
+    header->bytes_per_channel = CV_ELEM_SIZE1(type);
+    header->complete = 0;
+    header->row_bytes = row_bytes;
+    header->data_size = data_size;
+
+    image = cv::Mat(size.height, size.width, type, static_cast<uint8_t *>(mapping) + sizeof(RawImageHeader));
+}
+
+RawImage::~RawImage()
+{
+    image.release();
+    if (mapping)
+        munmap(mapping, mapping_size);
+}
+
+void
+RawImage::publish()
+{
+    // The pixels must be visible before the flag
+    std::atomic_thread_fence(std::memory_order_release);
+    static_cast<RawImageHeader *>(mapping)->complete = 1;
+}
+
+// Functions
+
+void
+write_raw_image(std::string path, RawOutputMode mode, const cv::Mat & image)
+{
+    RawImage raw_image(path, mode, image.size(), image.type());
+    image.copyTo(raw_image.image);
+    raw_image.publish();
+}
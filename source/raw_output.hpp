@@ -0,0 +1,72 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <string>
+
+// Uncompressed output images for local consumers (encoders, review tools). The
+// image is stored in a memory mapped file or a POSIX shared memory object as a
+// RawImageHeader followed by the pixel rows, so a consumer maps it and uses the
+// pixels in place, without decoding or copying them.
+
+const char RAW_IMAGE_MAGIC[8] = {'Z', 'M', 'R', 'A', 'W', 0, 0, 0};
+const uint32_t RAW_IMAGE_VERSION = 1;
+
+// Fixed little-endian layout, the pixels start at header_size (64) bytes.
+// 'complete' turns to 1 once all the pixels are written.
+struct RawImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t width;
+    uint32_t height;
+    // OpenCV type of the pixels, e.g. CV_16UC4 for the BGRA merge results
+    uint32_t type;
+    uint32_t channels;
+    uint32_t bytes_per_channel;
+    uint32_t complete;
+    uint64_t row_bytes;
+    uint64_t data_size;
+    uint8_t reserved[8];
+};
+
+static_assert(sizeof(RawImageHeader) == 64, "The raw image header must be 64 bytes!");
+
+enum class RawOutputMode {NONE, FILE, SHARED_MEMORY};
+
+class RawImage
+{
+    public:
+
+    // Maps a new raw image at 'path': a file, or for SHARED_MEMORY the POSIX shared
+    // memory object named after the file name of 'path' ("/<file name>"). An
+    // existing image is unlinked first, consumers still mapping it keep the old pixels.
+    RawImage(std::string path, RawOutputMode mode, cv::Size size, int type);
+
+    // Unmaps the image, the file or shared memory object stays for the consumers
+    ~RawImage();
+
+    RawImage(const RawImage &) = delete;
+    RawImage & operator=(const RawImage &) = delete;
+
+    // The pixels in the mapping, writing into it writes the output
+    cv::Mat image;
+
+    // Marks the pixels complete for the consumers
+    void
+    publish();
+
+    // The name of the shared memory object or the file path
+    std::string name;
+
+    private:
+
+    void * mapping = nullptr;
+    size_t mapping_size = 0;
+};
+
+// Writes 'image' as a raw image at 'path'
+void
+write_raw_image(std::string path, RawOutputMode mode, const cv::Mat & image);
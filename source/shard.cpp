@@ -0,0 +1,388 @@
+#include "shard.hpp"
+#include "consts.hpp"
+#include "json11.hpp"
+#include "utilities.hpp"
+#include "zimage.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char ** environ;
+
+// Helper functions
+
+void
+write_all(int fd, const void * data, size_t size)
+{
+    auto bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        auto written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw std::runtime_error(std::string("Shard transport write error: ") + std::strerror(errno));
+        bytes += written;
+        size -= written;
+    }
+}
+
+bool
+read_all(int fd, void * data, size_t size)
+{
+    // Returns false if the other end is closed before 'size' bytes
+    auto bytes = static_cast<char *>(data);
+    while (size > 0)
+    {
+        auto count = read(fd, bytes, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
+
+json11::Json
+rect_json(cv::Rect rect)
+{
+    return json11::Json::array{rect.x, rect.y, rect.width, rect.height};
+}
+
+cv::Rect
+parse_rect(const json11::Json & json)
+{
+    return cv::Rect(json[0].int_value(), json[1].int_value(), json[2].int_value(), json[3].int_value());
+}
+
+void *
+map_shared_memory(std::string name, size_t size, bool create)
+{
+    int fd = shm_open(name.c_str(), create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Can't open the shared memory " + name + ": " + std::strerror(errno));
+    if (create && ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Can't allocate the shared memory " + name + ": " + std::strerror(errno));
+    }
+
+    void * data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        if (create)
+            shm_unlink(name.c_str());
+        throw std::runtime_error("Can't map the shared memory " + name + ": " + std::strerror(errno));
+    }
+    return data;
+}
+
+// Requests
+
+std::string
+shard_request_json(const ShardRequest & request)
+{
+    json11::Json::array layers;
+    for (auto & layer : request.layers)
+        layers.push_back(json11::Json::object{
+            {"I", layer.rgba_file_path}, {"Z", layer.z_file_path}, {"M", static_cast<int>(layer.mode)}});
+
+    return json11::Json(json11::Json::object{
+        {"L", layers},
+        {"load_roi", rect_json(request.load_roi)},
+        {"band", rect_json(request.band)},
+        {"invert_z", request.invert_z},
+        {"expand_z", request.expand_z},
+        {"expand_radius", request.expand_radius},
+        {"half", request.half},
+        {"premultiplied", request.premultiplied},
+        {"premultiplied_output", request.premultiplied_output},
+        {"compress_layers", request.compress_layers},
+        {"shared_memory", request.shared_memory}
+    }).dump();
+}
+
+ShardRequest
+parse_shard_request(const std::string & json)
+{
+    std::string error_message;
+    auto entry = json11::Json::parse(json, error_message);
+    if (!error_message.empty())
+        throw std::runtime_error("Shard request error! " + error_message);
+
+    ShardRequest request;
+    for (auto & layer : entry["L"].array_items())
+    {
+        LayerEntry layer_entry;
+        layer_entry.rgba_file_path = layer["I"].string_value();
+        layer_entry.z_file_path = layer["Z"].string_value();
+        layer_entry.mode = static_cast<BlendMode>(layer["M"].int_value());
+        request.layers.push_back(layer_entry);
+    }
+    request.load_roi = parse_rect(entry["load_roi"]);
+    request.band = parse_rect(entry["band"]);
+    request.invert_z = entry["invert_z"].bool_value();
+    request.expand_z = entry["expand_z"].bool_value();
+    request.expand_radius = entry["expand_radius"].int_value();
+    request.half = entry["half"].bool_value();
+    request.premultiplied = entry["premultiplied"].bool_value();
+    request.premultiplied_output = entry["premultiplied_output"].bool_value();
+    request.compress_layers = entry["compress_layers"].bool_value();
+    request.shared_memory = entry["shared_memory"].string_value();
+
+    return request;
+}
+
+std::vector<cv::Rect>
+shard_bands(cv::Rect frame, int shards)
+{
+    int tile_rows = (frame.height + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+    int band_height = std::max(1, (tile_rows + shards - 1) / shards) * Z_TILE_SIZE;
+
+    std::vector<cv::Rect> bands;
+    for (int y = 0; y < frame.height; y += band_height)
+        bands.push_back(cv::Rect(frame.x, frame.y + y, frame.width, std::min(band_height, frame.height - y)));
+
+    return bands;
+}
+
+// Worker
+
+int
+run_shard_worker()
+{
+    // The standard output may carry the merged band, messages go to the standard error
+    try
+    {
+        std::string line;
+        std::getline(std::cin, line);
+        auto request = parse_shard_request(line);
+
+        int images_count = request.layers.size();
+        auto storage = request.half ? PixelStorage::HALF : PixelStorage::NATIVE;
+        auto zimage_set = ZImageSet(images_count);
+        zimage_set.half_accumulator = request.half;
+        zimage_set.premultiplied = request.premultiplied;
+        zimage_set.premultiplied_output = request.premultiplied_output;
+
+        // The coordinator has already expanded the roi, the first loading error is thrown
+        std::vector<std::string> errors;
+        auto load_layer = [&](int k, cv::Rect load_roi)
+        {
+            auto & layer = request.layers[k];
+            zimage_set.z_images[k] = ZImage(layer.rgba_file_path, layer.z_file_path,
+                                            layer.mode, load_roi, storage);
+        };
+        zimage_set.load_layers(request.load_roi, false, 0, {}, load_layer, errors);
+        if (!errors.empty())
+            throw std::runtime_error(errors[0]);
+
+        if (!zimage_set.resolution_check())
+            throw std::runtime_error("Resolution error! Input images have different resolutions.");
+        if (request.expand_z)
+            zimage_set.expand_z(request.invert_z, request.expand_radius);
+        zimage_set.sparse_layers();
+        if (request.compress_layers)
+            zimage_set.compress_layers();
+
+        auto result = zimage_set.merge_images(request.invert_z, {0, 0, 0, 0},
+                                              request.band - request.load_roi.tl());
+        size_t size = result.total() * result.elemSize();
+
+        if (request.shared_memory.empty())
+            write_all(STDOUT_FILENO, result.data, size);
+        else
+        {
+            void * data = map_shared_memory(request.shared_memory, size, false);
+            std::memcpy(data, result.data, size);
+            munmap(data, size);
+        }
+    }
+    catch (const std::exception & error)
+    {
+        std::cerr << "Shard worker error! " << error.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// PipeTransport
+
+PipeTransport::PipeTransport(std::vector<std::string> worker_command, std::vector<std::string> launchers)
+: worker_command(worker_command), launchers(launchers)
+{
+    signal(SIGPIPE, SIG_IGN);
+}
+
+PipeTransport::~PipeTransport()
+{
+    for (auto & worker : workers)
+    {
+        close(worker.second.output_fd);
+        waitpid(worker.second.pid, nullptr, 0);
+    }
+}
+
+void
+PipeTransport::start(int shard, ShardRequest request)
+{
+    std::vector<std::string> arguments;
+    if (!launchers.empty())
+    {
+        for (auto & item : split(launchers[shard % launchers.size()], ' '))
+        {
+            if (!item.empty())
+                arguments.push_back(item);
+        }
+    }
+    arguments.insert(arguments.end(), worker_command.begin(), worker_command.end());
+
+    std::vector<char *> argv;
+    for (auto & argument : arguments)
+        argv.push_back(const_cast<char *>(argument.c_str()));
+    argv.push_back(nullptr);
+
+    // Only the duplicated ends of the pipes are inherited by the worker
+    int input_pipe[2];
+    int output_pipe[2];
+    if (pipe2(input_pipe, O_CLOEXEC) != 0)
+        throw std::runtime_error(std::string("Can't create a pipe: ") + std::strerror(errno));
+    if (pipe2(output_pipe, O_CLOEXEC) != 0)
+    {
+        close(input_pipe[0]);
+        close(input_pipe[1]);
+        throw std::runtime_error(std::string("Can't create a pipe: ") + std::strerror(errno));
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input_pipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output_pipe[1], STDOUT_FILENO);
+
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+    if (error != 0)
+    {
+        close(input_pipe[1]);
+        close(output_pipe[0]);
+        throw std::runtime_error("Can't start the shard worker " + arguments[0] + ": " + std::strerror(error));
+    }
+    workers[shard] = {pid, output_pipe[0]};
+
+    // A worker exiting early is reported as a failed shard, not a broken pipe
+    auto json = shard_request_json(request) + "\n";
+    try
+    {
+        write_all(input_pipe[1], json.data(), json.size());
+    }
+    catch (...)
+    {
+        close(input_pipe[1]);
+        wait_worker(shard);
+        throw;
+    }
+    close(input_pipe[1]);
+}
+
+void
+PipeTransport::finish(int shard, cv::Mat_<cv::Vec<uint16_t, 4>> band_result)
+{
+    // The band may be a part of a larger image, it's read row by row
+    bool complete = true;
+    for (int i = 0; i < band_result.rows && complete; ++i)
+        complete = read_all(workers[shard].output_fd, band_result[i], band_result.cols * band_result.elemSize());
+
+    wait_worker(shard);
+    if (!complete)
+        throw std::runtime_error("Shard " + std::to_string(shard) + " returned an incomplete band!");
+}
+
+void
+PipeTransport::wait_worker(int shard)
+{
+    auto worker = workers[shard];
+    workers.erase(shard);
+
+    close(worker.output_fd);
+    int status = 0;
+    while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error("Shard " + std::to_string(shard) + " failed!");
+}
+
+// SharedMemoryTransport
+
+SharedMemoryTransport::SharedMemoryTransport(std::vector<std::string> worker_command)
+: PipeTransport(worker_command)
+{
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+    for (auto & segment : segments)
+        release(segment.second);
+}
+
+void
+SharedMemoryTransport::start(int shard, ShardRequest request)
+{
+    Segment segment;
+    segment.name = "/zmerger_" + std::to_string(getpid()) + "_" + std::to_string(shard);
+    segment.size = request.band.area() * sizeof(cv::Vec<uint16_t, 4>);
+    segment.data = map_shared_memory(segment.name, segment.size, true);
+    segments[shard] = segment;
+
+    request.shared_memory = segment.name;
+    PipeTransport::start(shard, request);
+}
+
+void
+SharedMemoryTransport::finish(int shard, cv::Mat_<cv::Vec<uint16_t, 4>> band_result)
+{
+    auto segment = segments[shard];
+    segments.erase(shard);
+
+    try
+    {
+        wait_worker(shard);
+    }
+    catch (...)
+    {
+        release(segment);
+        throw;
+    }
+
+    cv::Mat_<cv::Vec<uint16_t, 4>>(band_result.rows, band_result.cols,
+                                   static_cast<cv::Vec<uint16_t, 4> *>(segment.data)).copyTo(band_result);
+    release(segment);
+}
+
+void
+SharedMemoryTransport::release(Segment & segment)
+{
+    munmap(segment.data, segment.size);
+    shm_unlink(segment.name.c_str());
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "manifest.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Sharded merge. The coordinator splits the frame into bands of whole Z_TILE_SIZE
+// tile rows, every band is merged by a worker process which loads only the band
+// of the layers (plus the rows the z-pass expansion needs), and the transport
+// brings the merged bands back to the coordinator.
+
+// The work of one worker, sent to it as a json line on its standard input
+struct ShardRequest
+{
+    std::vector<LayerEntry> layers;
+    // Part of the layers to load and the band to merge, in frame coordinates
+    cv::Rect load_roi;
+    cv::Rect band;
+    bool invert_z = false;
+    bool expand_z = false;
+    int expand_radius = 0;
+    bool half = false;
+    bool premultiplied = false;
+    bool premultiplied_output = false;
+    bool compress_layers = false;
+    // Where the merged band goes: the standard output of the worker if empty,
+    // otherwise the POSIX shared memory object of that name
+    std::string shared_memory;
+};
+
+std::string
+shard_request_json(const ShardRequest & request);
+
+ShardRequest
+parse_shard_request(const std::string & json);
+
+// Splits 'frame' into at most 'shards' bands of whole tile rows
+std::vector<cv::Rect>
+shard_bands(cv::Rect frame, int shards);
+
+// Merges the request read from the standard input, the exit code of a worker
+int
+run_shard_worker();
+
+// Moves the work to the workers and their merged bands back
+class ShardTransport
+{
+    public:
+
+    virtual ~ShardTransport() {}
+
+    // Starts the worker of the shard
+    virtual void
+    start(int shard, ShardRequest request) = 0;
+
+    // Waits for the worker of the shard and stores its band into 'band_result'
+    virtual void
+    finish(int shard, cv::Mat_<cv::Vec<uint16_t, 4>> band_result) = 0;
+};
+
+// Runs the workers as child processes, the merged bands come back through their
+// standard output. Worker k runs launchers[k % launchers.size()] followed by the
+// worker command, so a launcher like "ssh node1" runs it on another machine.
+class PipeTransport : public ShardTransport
+{
+    public:
+
+    PipeTransport(std::vector<std::string> worker_command,
+                  std::vector<std::string> launchers = {});
+    ~PipeTransport();
+
+    void
+    start(int shard, ShardRequest request) override;
+
+    void
+    finish(int shard, cv::Mat_<cv::Vec<uint16_t, 4>> band_result) override;
+
+    protected:
+
+    struct Worker
+    {
+        pid_t pid = -1;
+        int output_fd = -1;
+    };
+
+    void
+    wait_worker(int shard);
+
+    std::vector<std::string> worker_command;
+    std::vector<std::string> launchers;
+    std::map<int, Worker> workers;
+};
+
+// Local workers writing their bands straight into shared memory
+class SharedMemoryTransport : public PipeTransport
+{
+    public:
+
+    SharedMemoryTransport(std::vector<std::string> worker_command);
+    ~SharedMemoryTransport();
+
+    void
+    start(int shard, ShardRequest request) override;
+
+    void
+    finish(int shard, cv::Mat_<cv::Vec<uint16_t, 4>> band_result) override;
+
+    private:
+
+    struct Segment
+    {
+        std::string name;
+        void * data = nullptr;
+        size_t size = 0;
+    };
+
+    void
+    release(Segment & segment);
+
+    std::map<int, Segment> segments;
+};
@@ -0,0 +1,170 @@
+#include "tile_codec.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Helper functions
+
+inline void
+write_varint(uint64_t value, std::vector<uint8_t> & data)
+{
+    while (value >= 0x80)
+    {
+        data.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    data.push_back(static_cast<uint8_t>(value));
+}
+
+inline uint64_t
+read_varint(const uint8_t * & data)
+{
+    uint64_t value = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        uint8_t byte = *data++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return value;
+    }
+}
+
+inline uint64_t
+zigzag(int64_t value)
+{
+    return (value < 0) ? ((uint64_t(~value) << 1) | 1) : (uint64_t(value) << 1);
+}
+
+inline int64_t
+unzigzag(uint64_t value)
+{
+    return (value & 1) ? ~int64_t(value >> 1) : int64_t(value >> 1);
+}
+
+// Samples are handled as unsigned integers of their size, float bits included.
+// Tokens are varints, the lowest bit tells a run of zero residuals (1)
+// from a single zigzagged residual (0).
+template <typename U>
+void
+encode_samples(const cv::Mat & tile, std::vector<uint8_t> & data)
+{
+    using S = typename std::make_signed<U>::type;
+    int channels = tile.channels();
+    int samples = tile.cols * channels;
+
+    for (int c = 0; c < channels; ++c)
+    {
+        U previous = 0;
+        uint64_t zero_run = 0;
+        for (int i = 0; i < tile.rows; ++i)
+        {
+            const U * row = tile.ptr<U>(i);
+            for (int k = c; k < samples; k += channels)
+            {
+                S residual = static_cast<S>(static_cast<U>(row[k] - previous));
+                previous = row[k];
+                if (residual == 0)
+                {
+                    ++zero_run;
+                    continue;
+                }
+                if (zero_run > 0)
+                    write_varint((zero_run << 1) | 1, data);
+                write_varint(zigzag(residual) << 1, data);
+                zero_run = 0;
+            }
+        }
+        if (zero_run > 0)
+            write_varint((zero_run << 1) | 1, data);
+    }
+}
+
+template <typename U>
+void
+decode_samples(const uint8_t * data, cv::Mat & tile)
+{
+    int channels = tile.channels();
+    int samples = tile.cols * channels;
+
+    for (int c = 0; c < channels; ++c)
+    {
+        U previous = 0;
+        uint64_t zero_run = 0;
+        for (int i = 0; i < tile.rows; ++i)
+        {
+            U * row = tile.ptr<U>(i);
+            for (int k = c; k < samples; k += channels)
+            {
+                if (zero_run == 0)
+                {
+                    uint64_t token = read_varint(data);
+                    if (token & 1)
+                        zero_run = token >> 1;
+                    else
+                        previous = static_cast<U>(previous + static_cast<U>(unzigzag(token >> 1)));
+                }
+                if (zero_run > 0)
+                    --zero_run;
+                row[k] = previous;
+            }
+        }
+    }
+}
+
+// Tile codec
+
+// The first byte tells the coded tiles from the raw ones, tiles that don't
+// shrink (noise) are stored as they are.
+const uint8_t RAW_TILE = 0;
+const uint8_t CODED_TILE = 1;
+
+void
+encode_tile(const cv::Mat & tile, std::vector<uint8_t> & data)
+{
+    size_t start = data.size();
+    size_t raw_size = tile.total() * tile.elemSize();
+    data.push_back(CODED_TILE);
+
+    switch (tile.elemSize1())
+    {
+        case 1: encode_samples<uint8_t>(tile, data); break;
+        case 2: encode_samples<uint16_t>(tile, data); break;
+        case 4: encode_samples<uint32_t>(tile, data); break;
+        default: throw std::runtime_error("Unsupported tile format!");
+    }
+
+    if (data.size() - start - 1 >= raw_size)
+    {
+        data.resize(start);
+        data.push_back(RAW_TILE);
+        size_t row_size = tile.cols * tile.elemSize();
+        for (int i = 0; i < tile.rows; ++i)
+            data.insert(data.end(), tile.ptr(i), tile.ptr(i) + row_size);
+    }
+}
+
+void
+decode_tile(const uint8_t * data, cv::Mat & tile)
+{
+    if (*data++ == RAW_TILE)
+    {
+        size_t row_size = tile.cols * tile.elemSize();
+        for (int i = 0; i < tile.rows; ++i, data += row_size)
+            std::memcpy(tile.ptr(i), data, row_size);
+        return;
+    }
+
+    switch (tile.elemSize1())
+    {
+        case 1: decode_samples<uint8_t>(data, tile); break;
+        case 2: decode_samples<uint16_t>(data, tile); break;
+        case 4: decode_samples<uint32_t>(data, tile); break;
+        default: throw std::runtime_error("Unsupported tile format!");
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lossless codec for image tiles of any depth and channel count. Every channel
+// sample is predicted by the previous sample of the same channel, the zigzagged
+// residuals are written as varints and runs of zero residuals as a single count,
+// so empty and flat regions and smooth depth shrink to a few bytes.
+
+// Appends the encoded tile to 'data'
+void
+encode_tile(const cv::Mat & tile, std::vector<uint8_t> & data);
+
+// Decodes into 'tile', which must already have the size and type of the encoded one
+void
+decode_tile(const uint8_t * data, cv::Mat & tile);
@@ -1,11 +1,16 @@
 #include "utilities.hpp"
 
 #include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
 
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 // Timing
 
@@ -34,6 +39,53 @@ lstrip(std::string s)
     return s;
 }
 
+std::string
+file_extension(std::string file_path)
+{
+    // The function returns the extension with the dot ("out/frame.png" -> ".png"),
+    // or an empty string if there is none.
+
+    auto dot = file_path.find_last_of('.');
+    auto slash = file_path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return "";
+    return file_path.substr(dot);
+}
+
+std::string
+suffixed_path(std::string file_path, std::string suffix)
+{
+    // The function inserts 'suffix' before the file extension:
+    // ("out/frame.png", "_half") -> "out/frame_half.png".
+
+    auto extension = file_extension(file_path);
+    return file_path.substr(0, file_path.size() - extension.size()) + suffix + extension;
+}
+
+std::vector<std::string>
+split(std::string s, char delimiter)
+{
+    // The function splits a string like "a,b,c" into its items.
+
+    std::vector<std::string> items;
+    std::string item;
+    std::stringstream stream(s);
+    while (std::getline(stream, item, delimiter))
+        items.push_back(item);
+    return items;
+}
+
+std::vector<int>
+split_ints(std::string s, char delimiter)
+{
+    // The function splits a string like "10,20,30" into integers.
+
+    std::vector<int> values;
+    for (auto & item : split(s, delimiter))
+        values.push_back(std::stoi(item));
+    return values;
+}
+
 std::string
 read_json_string(std::string json_file_path)
 {
@@ -51,6 +103,107 @@ read_json_string(std::string json_file_path)
     return json_string;
 }
 
+// Images
+
+bool
+has_png_chunk(std::ifstream & file, const char * name)
+{
+    // The chunks after IHDR up to the image data, tRNS comes before it
+    file.seekg(33);
+    unsigned char chunk[8];
+    while (file.read(reinterpret_cast<char *>(chunk), sizeof(chunk)))
+    {
+        if (std::memcmp(chunk + 4, name, 4) == 0)
+            return true;
+        if (std::memcmp(chunk + 4, "IDAT", 4) == 0 || std::memcmp(chunk + 4, "IEND", 4) == 0)
+            return false;
+        uint32_t length = (chunk[0] << 24) | (chunk[1] << 16) | (chunk[2] << 8) | chunk[3];
+        file.seekg(length + 4, std::ios::cur);
+    }
+    return false;
+}
+
+ImageHeader
+read_image_header(std::string file_path)
+{
+    // A PNG file starts with the signature and the IHDR chunk holding the
+    // big-endian width and height, the bit depth and the colour type. The
+    // channels are the ones imread(IMREAD_UNCHANGED) decodes, which depend on a
+    // tRNS chunk as well.
+    ImageHeader header;
+    std::ifstream file(file_path, std::ios::binary);
+    unsigned char bytes[26] = {};
+    file.read(reinterpret_cast<char *>(bytes), sizeof(bytes));
+    if (!file || bytes[1] != 'P' || bytes[2] != 'N' || bytes[3] != 'G'
+        || bytes[12] != 'I' || bytes[13] != 'H' || bytes[14] != 'D' || bytes[15] != 'R')
+        return header;
+
+    auto read_u32 = [&bytes](int k)
+    {
+        return (bytes[k] << 24) | (bytes[k + 1] << 16) | (bytes[k + 2] << 8) | bytes[k + 3];
+    };
+    header.size = cv::Size(read_u32(16), read_u32(20));
+
+    // Bit depths below 8 are decoded to 8 bits, a depth PNG doesn't have is left 0
+    switch (bytes[24])
+    {
+        case 1: case 2: case 4: case 8: header.bytes_per_channel = 1; break;
+        case 16: header.bytes_per_channel = 2; break;
+        default: break;
+    }
+
+    // Grayscale, RGB and palette (BGRA with a tRNS chunk), grayscale with alpha
+    // and RGBA (both BGRA)
+    switch (bytes[25])
+    {
+        case 0: header.channels = 1; break;
+        case 4: case 6: header.channels = 4; break;
+        default: header.channels = has_png_chunk(file, "tRNS") ? 4 : 3; break;
+    }
+
+    return header;
+}
+
+cv::Size
+image_size(std::string file_path)
+{
+    auto header = read_image_header(file_path);
+    if (!header.size.empty())
+        return header.size;
+
+    return cv::imread(file_path, cv::IMREAD_UNCHANGED).size();
+}
+
+// Hashing
+
+uint64_t
+hash_bytes(const void * data, size_t size, uint64_t seed)
+{
+    // Multiply-xorshift over 8-byte words, finished with the murmur3 mix
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    auto bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = seed ^ (size * multiplier);
+
+    size_t k = 0;
+    for (; k + 8 <= size; k += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + k, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + k, size - k);
+    hash = (hash ^ tail) * multiplier;
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
 // Debugging
 
 void
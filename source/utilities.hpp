@@ -3,8 +3,10 @@
 #include <opencv2/core.hpp>
 
 #include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <vector>
 
 // Printing
 
@@ -42,9 +44,46 @@ time_from(std::chrono::time_point<std::chrono::steady_clock, std::chrono::millis
 
 std::string lstrip(std::string s);
 
+std::string
+file_extension(std::string file_path);
+
+std::string
+suffixed_path(std::string file_path, std::string suffix);
+
+std::vector<std::string>
+split(std::string s, char delimiter=',');
+
+std::vector<int>
+split_ints(std::string s, char delimiter=',');
+
 std::string
 read_json_string(std::string json_file_path);
 
+// Hashing
+
+// Fast 64-bit hash of a byte range (not cryptographic), 'seed' chains the ranges
+uint64_t
+hash_bytes(const void * data, size_t size, uint64_t seed = 0);
+
+// Images
+
+// Layout of the decoded pixels of an image file
+struct ImageHeader
+{
+    cv::Size size;
+    int channels = 0;
+    int bytes_per_channel = 0;
+};
+
+// Reads the header of PNG files, other formats give an empty header. A bit depth
+// PNG doesn't define gives 0 bytes per channel.
+ImageHeader
+read_image_header(std::string file_path);
+
+// Resolution of an image file, read from the header of PNG files
+cv::Size
+image_size(std::string file_path);
+
 // Debugging
 
 void print_mat(cv::Mat, std::string);
@@ -0,0 +1,469 @@
+#include "validation.hpp"
+#include "consts.hpp"
+#include "enums.hpp"
+#include "utilities.hpp"
+#include "zimage.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+struct TestLayer
+{
+    cv::Mat rgba;
+    cv::Mat z;
+    BlendMode mode;
+};
+
+struct TestCase
+{
+    std::string name;
+    std::vector<TestLayer> layers;
+};
+
+struct KernelVariant
+{
+    std::string name;
+    PixelStorage storage;
+    // Largest accepted error in 16-bit code values
+    int tolerance;
+    std::function<void(ZImageSet &)> setup;
+    std::function<cv::Mat_<cv::Vec<uint16_t, 4>>(ZImageSet &, bool)> merge;
+};
+
+enum class DepthLayout {RANDOM, EQUAL, SORTED};
+enum class AlphaLayout {MIXED, BINARY, SPARSE};
+
+// Helper functions
+
+TestCase
+generate_case(std::string name, int layers_count, cv::Size size, std::mt19937 & rng,
+              DepthLayout depth, AlphaLayout alpha, int mode = -1, int type = CV_16UC4)
+{
+    // mode -1 picks a random blend mode for every layer, float colours are within [0, 1]
+    TestCase test_case;
+    test_case.name = name;
+    int channels = CV_MAT_CN(type);
+    int max_value = (CV_MAT_DEPTH(type) == CV_8U) ? MAX_8_BIT_VALUE : MAX_16_BIT_VALUE;
+
+    for (int m = 0; m < layers_count; ++m)
+    {
+        TestLayer layer;
+        layer.mode = static_cast<BlendMode>(mode < 0 ? rng() % 3 : mode);
+        layer.rgba = cv::Mat(size.height, size.width, type);
+        layer.z = cv::Mat(size.height, size.width, CV_16UC1);
+
+        for (int i = 0; i < size.height; ++i)
+        {
+            for (int j = 0; j < size.width; ++j)
+            {
+                int a = rng() % (max_value + 1);
+                if (alpha == AlphaLayout::BINARY || (alpha == AlphaLayout::MIXED && rng() % 2))
+                    a = (rng() % 2) ? max_value : 0;
+                else if (alpha == AlphaLayout::SPARSE && rng() % 8)
+                    a = 0;
+
+                int values[4] = {int(rng() % (max_value + 1)), int(rng() % (max_value + 1)), int(rng() % (max_value + 1)), a};
+                for (int c = 0; c < channels; ++c)
+                {
+                    if (CV_MAT_DEPTH(type) == CV_8U)
+                        layer.rgba.ptr<uint8_t>(i)[channels * j + c] = values[c];
+                    else if (CV_MAT_DEPTH(type) == CV_32F)
+                        layer.rgba.ptr<float>(i)[channels * j + c] = values[c] / MAX_16_BIT_VALUE_F;
+                    else
+                        layer.rgba.ptr<uint16_t>(i)[channels * j + c] = values[c];
+                }
+
+                uint16_t z = 0;
+                if (depth == DepthLayout::RANDOM)
+                    z = rng() % 8 * 1000;
+                else if (depth == DepthLayout::EQUAL)
+                    z = 5000;
+                else
+                    z = std::min<int>(MAX_16_BIT_VALUE, m * 1000 + rng() % 900);
+                layer.z.ptr<uint16_t>(i)[j] = z;
+            }
+        }
+        test_case.layers.push_back(layer);
+    }
+
+    return test_case;
+}
+
+cv::Mat_<cv::Vec<uint16_t, 4>>
+reference_merge(const TestCase & test_case, bool invert_z)
+{
+    // The plain scalar path: every pixel sorts all the layers, straight alpha blending
+    auto & layers = test_case.layers;
+    int rows = layers[0].rgba.rows;
+    int cols = layers[0].rgba.cols;
+    cv::Mat_<cv::Vec<float, 4>> result(rows, cols, cv::Vec<float, 4>(0, 0, 0, 0));
+
+    #pragma omp parallel for
+    for (int i = 0; i < rows; ++i)
+    {
+        std::vector<int> order(layers.size());
+        for (int j = 0; j < cols; ++j)
+        {
+            std::iota(order.begin(), order.end(), 0);
+            auto z = [&](int m) { return layers[m].z.ptr<uint16_t>(i)[j]; };
+            if (invert_z)
+                std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return z(a) > z(b); });
+            else
+                std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return z(a) < z(b); });
+
+            for (int m : order)
+            {
+                // Layers without alpha channel are opaque
+                auto & rgba = layers[m].rgba;
+                int channels = rgba.channels();
+                cv::Vec<float, 4> pixel(0, 0, 0, 1);
+                for (int c = 0; c < channels; ++c)
+                {
+                    if (rgba.depth() == CV_8U)
+                        pixel[c] = (rgba.ptr<uint8_t>(i)[channels * j + c] * 257) / MAX_16_BIT_VALUE_F;
+                    else if (rgba.depth() == CV_32F)
+                        pixel[c] = rgba.ptr<float>(i)[channels * j + c];
+                    else
+                        pixel[c] = rgba.ptr<uint16_t>(i)[channels * j + c] / MAX_16_BIT_VALUE_F;
+                }
+                blend_pixel(result(i, j), pixel, layers[m].mode, result(i, j));
+            }
+        }
+    }
+
+    return cv::Mat_<cv::Vec<uint16_t, 4>>(result*MAX_16_BIT_VALUE);
+}
+
+cv::Mat
+reference_expand_z(const cv::Mat & z, int radius, bool minimum)
+{
+    // The square window clipped to the image, as the default border of cv::erode/cv::dilate
+    cv::Mat result(z.rows, z.cols, CV_16UC1);
+    #pragma omp parallel for
+    for (int i = 0; i < z.rows; ++i)
+    {
+        for (int j = 0; j < z.cols; ++j)
+        {
+            uint16_t value = z.ptr<uint16_t>(i)[j];
+            for (int y = std::max(0, i - radius); y <= std::min(z.rows - 1, i + radius); ++y)
+            {
+                for (int x = std::max(0, j - radius); x <= std::min(z.cols - 1, j + radius); ++x)
+                    value = minimum ? std::min(value, z.ptr<uint16_t>(y)[x]) : std::max(value, z.ptr<uint16_t>(y)[x]);
+            }
+            result.ptr<uint16_t>(i)[j] = value;
+        }
+    }
+    return result;
+}
+
+void
+compare(const cv::Mat_<cv::Vec<uint16_t, 4>> & a, const cv::Mat_<cv::Vec<uint16_t, 4>> & b,
+        int & max_error, double & mean_error)
+{
+    max_error = 0;
+    double sum = 0;
+    for (int i = 0; i < a.rows; ++i)
+    {
+        for (int j = 0; j < a.cols; ++j)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                int error = std::abs(int(a(i, j)[c]) - int(b(i, j)[c]));
+                max_error = std::max(max_error, error);
+                sum += error;
+            }
+        }
+    }
+    mean_error = sum / (4.0 * a.total());
+}
+
+// Validation
+
+void
+write_png_header(const std::string & file_path, int colour_type, int bit_depth, bool transparency)
+{
+    // Just the chunks before the image data, the CRCs are not checked
+    auto chunk = [](std::ofstream & file, const char * name, std::vector<uint8_t> data)
+    {
+        uint8_t length[4] = {0, 0, 0, static_cast<uint8_t>(data.size())};
+        uint8_t crc[4] = {};
+        file.write(reinterpret_cast<char *>(length), 4);
+        file.write(name, 4);
+        file.write(reinterpret_cast<char *>(data.data()), data.size());
+        file.write(reinterpret_cast<char *>(crc), 4);
+    };
+
+    std::ofstream file(file_path, std::ios::binary);
+    file.write("\x89PNG\r\n\x1a\n", 8);
+    chunk(file, "IHDR", {0, 0, 0, 16, 0, 0, 0, 8, static_cast<uint8_t>(bit_depth),
+                         static_cast<uint8_t>(colour_type), 0, 0, 0});
+    if (colour_type == 3)
+        chunk(file, "PLTE", {0, 0, 0, 255, 255, 255});
+    if (transparency)
+        chunk(file, "tRNS", (colour_type == 2) ? std::vector<uint8_t>(6) : std::vector<uint8_t>(2));
+    chunk(file, "IDAT", {});
+    chunk(file, "IEND", {});
+}
+
+bool
+validate_image_headers()
+{
+    // The channels read_image_header gives must be the ones imread(IMREAD_UNCHANGED) decodes
+    struct HeaderCase
+    {
+        std::string name;
+        int colour_type;
+        int bit_depth;
+        bool transparency;
+        int channels;
+        int bytes_per_channel;
+    };
+    std::vector<HeaderCase> cases = {
+        {"gray", 0, 16, false, 1, 2},
+        {"gray tRNS", 0, 8, true, 1, 1},
+        {"gray alpha", 4, 8, false, 4, 1},
+        {"gray alpha 16", 4, 16, false, 4, 2},
+        {"rgb", 2, 8, false, 3, 1},
+        {"rgb tRNS", 2, 16, true, 4, 2},
+        {"palette", 3, 8, false, 3, 1},
+        {"palette 4-bit", 3, 4, false, 3, 1},
+        {"palette tRNS", 3, 8, true, 4, 1},
+        {"rgba", 6, 16, false, 4, 2},
+        {"rgba 12-bit", 6, 12, false, 4, 0}
+    };
+
+    char file_path[] = "/tmp/zmerger_header_XXXXXX";
+    int fd = mkstemp(file_path);
+    if (fd < 0)
+        return false;
+    close(fd);
+
+    bool passed = true;
+    for (auto & header_case : cases)
+    {
+        write_png_header(file_path, header_case.colour_type, header_case.bit_depth, header_case.transparency);
+        auto header = read_image_header(file_path);
+        bool ok = header.size == cv::Size(16, 8) && header.channels == header_case.channels &&
+                  header.bytes_per_channel == header_case.bytes_per_channel;
+        passed = passed && ok;
+        std::cout << std::left << std::setw(16) << header_case.name << std::setw(16) << "png header"
+                  << std::right << std::setw(10) << header.channels << " channels"
+                  << (ok ? "" : "  FAILED") << std::endl;
+    }
+    std::remove(file_path);
+
+    return passed;
+}
+
+bool
+validate_kernels(cv::Size size, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    int normal = static_cast<int>(BlendMode::NORMAL);
+    int multiply = static_cast<int>(BlendMode::MULTIPLY);
+    int screen = static_cast<int>(BlendMode::SCREEN);
+
+    std::vector<TestCase> cases = {
+        generate_case("random", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED),
+        generate_case("equal z", 8, size, rng, DepthLayout::EQUAL, AlphaLayout::MIXED),
+        generate_case("binary alpha", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::BINARY),
+        generate_case("sparse alpha", 16, size, rng, DepthLayout::RANDOM, AlphaLayout::SPARSE),
+        generate_case("normal only", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, normal),
+        generate_case("multiply only", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, multiply),
+        generate_case("screen only", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, screen),
+        generate_case("sorted tiles", 8, size, rng, DepthLayout::SORTED, AlphaLayout::MIXED),
+        generate_case("8-bit", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, -1, CV_8UC4),
+        generate_case("rgb", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, -1, CV_16UC3),
+        generate_case("8-bit rgb", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, -1, CV_8UC3),
+        generate_case("float", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, -1, CV_32FC4),
+        generate_case("float rgb", 8, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED, -1, CV_32FC3),
+        generate_case("many layers", 300, size, rng, DepthLayout::RANDOM, AlphaLayout::MIXED)
+    };
+
+    auto merge = [](ZImageSet & set, bool invert_z) { return set.merge_images(invert_z); };
+    auto no_setup = [](ZImageSet &) {};
+    // The colours again as a colour AOV, the fan-out must merge both the same
+    auto aov_setup = [](ZImageSet & set)
+    {
+        for (auto & image : set.z_images)
+            image.add_aov(image.rgba_mat);
+    };
+    std::vector<KernelVariant> variants = {
+        {"native", PixelStorage::NATIVE, 0, no_setup, merge},
+        {"uint16", PixelStorage::UINT16, 0, no_setup, merge},
+        {"compressed", PixelStorage::NATIVE, 0, [](ZImageSet & set) { set.compress_layers(); }, merge},
+        {"sparse", PixelStorage::NATIVE, 0, [](ZImageSet & set) { set.sparse_layers(1.0f); }, merge},
+        {"fan-out", PixelStorage::NATIVE, 0, aov_setup, [](ZImageSet & set, bool invert_z)
+            {
+                return set.merge_images_fan_out(invert_z)[0];
+            }},
+        {"fan-out aov", PixelStorage::NATIVE, 0, aov_setup, [](ZImageSet & set, bool invert_z)
+            {
+                return set.merge_images_fan_out(invert_z)[1];
+            }},
+        {"reuse", PixelStorage::NATIVE, 0, [](ZImageSet & set)
+            {
+                for (auto & image : set.z_images)
+                    image.compute_tile_hashes();
+            },
+            [](ZImageSet & set, bool invert_z)
+            {
+                // The previous frame lacks the first tile of the first layer, it is merged
+                // again and the others reused. A merge reusing none of them fails too.
+                TileReuse reuse;
+                ZImageSet previous = set;
+                auto & layer = previous.z_images[0];
+                cv::Rect frame(0, 0, layer.width, layer.height);
+                layer.rgba_mat = layer.rgba_mat.clone();
+                layer.rgba_mat(cv::Rect(0, 0, Z_TILE_SIZE, Z_TILE_SIZE) & frame).setTo(cv::Scalar(0, 0, 0, 0));
+                layer.compute_z_bounds();
+                layer.compute_tile_hashes();
+                previous.tile_reuse = &reuse;
+                auto previous_result = previous.merge_images(invert_z);
+
+                set.tile_reuse = &reuse;
+                auto result = set.merge_images(invert_z);
+                set.tile_reuse = nullptr;
+                bool single_tile = (layer.width <= Z_TILE_SIZE && layer.height <= Z_TILE_SIZE);
+                return (reuse.tiles_reused > 0 || single_tile) ? result : previous_result;
+            }},
+        {"progressive", PixelStorage::NATIVE, 0, no_setup, [](ZImageSet & set, bool invert_z)
+            {
+                return set.merge_images_progressive(invert_z, {0, 0, 0, 0}, cv::Rect(),
+                                                    [](const cv::Mat_<cv::Vec<uint16_t, 4>> &, int) {});
+            }},
+        {"premultiplied", PixelStorage::NATIVE, 1, [](ZImageSet & set) { set.premultiplied = true; }, merge},
+        {"half", PixelStorage::HALF, 64, [](ZImageSet & set) { set.half_accumulator = true; }, merge}
+    };
+
+    bool passed = validate_image_headers();
+    std::cout << std::left << std::setw(16) << "case" << std::setw(16) << "kernel" << std::setw(10) << "z"
+              << std::right << std::setw(10) << "max err" << std::setw(12) << "mean err"
+              << std::setw(12) << "MP/s" << std::endl;
+
+    for (auto & test_case : cases)
+    {
+        for (bool invert_z : {false, true})
+        {
+            auto reference = reference_merge(test_case, invert_z);
+            for (auto & variant : variants)
+            {
+                ZImageSet set(test_case.layers.size());
+                for (size_t m = 0; m < test_case.layers.size(); ++m)
+                {
+                    auto & layer = test_case.layers[m];
+                    set.z_images[m] = ZImage(layer.rgba, layer.z, layer.mode, cv::Rect(), variant.storage);
+                }
+                variant.setup(set);
+
+                auto start = std::chrono::steady_clock::now();
+                auto result = variant.merge(set, invert_z);
+                std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+                int max_error;
+                double mean_error;
+                compare(result, reference, max_error, mean_error);
+                bool ok = (max_error <= variant.tolerance);
+                passed = passed && ok;
+
+                std::cout << std::left << std::setw(16) << test_case.name << std::setw(16) << variant.name
+                          << std::setw(10) << (invert_z ? "inverted" : "normal")
+                          << std::right << std::setw(10) << max_error
+                          << std::setw(12) << std::fixed << std::setprecision(4) << mean_error
+                          << std::setw(12) << std::setprecision(2) << size.area() / 1e6 / seconds.count()
+                          << (ok ? "" : "  FAILED") << std::endl;
+            }
+        }
+    }
+
+    // The layers grown by a square must merge as the layers with the z-passes
+    // grown by the plain scalar filter
+    auto & expand_case = cases[0];
+    for (int radius : {1, 3, 20})
+    {
+        for (bool invert_z : {false, true})
+        {
+            TestCase expanded = expand_case;
+            ZImageSet set(expand_case.layers.size());
+            for (size_t m = 0; m < expand_case.layers.size(); ++m)
+            {
+                auto & layer = expand_case.layers[m];
+                expanded.layers[m].z = reference_expand_z(layer.z, radius, invert_z);
+                set.z_images[m] = ZImage(layer.rgba, layer.z.clone(), layer.mode);
+            }
+            auto reference = reference_merge(expanded, invert_z);
+
+            auto start = std::chrono::steady_clock::now();
+            set.expand_z(invert_z, radius);
+            auto result = set.merge_images(invert_z);
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+            int max_error;
+            double mean_error;
+            compare(result, reference, max_error, mean_error);
+            bool ok = (max_error == 0);
+            passed = passed && ok;
+
+            std::cout << std::left << std::setw(16) << "expand z" << std::setw(16) << ("radius " + std::to_string(radius))
+                      << std::setw(10) << (invert_z ? "inverted" : "normal")
+                      << std::right << std::setw(10) << max_error
+                      << std::setw(12) << std::fixed << std::setprecision(4) << mean_error
+                      << std::setw(12) << std::setprecision(2) << size.area() / 1e6 / seconds.count()
+                      << (ok ? "" : "  FAILED") << std::endl;
+        }
+    }
+
+    // A roi merged with a z-pass expansion must be the crop of the full merge,
+    // the roi is loaded with the pixels around it the expansion reads
+    cv::Rect roi(size.width / 4, size.height / 4, size.width / 2, size.height / 2);
+    auto & roi_case = cases[0];
+    for (int radius : {0, 3})
+    {
+        auto load_roi = expansion_roi(roi, size, radius);
+        ZImageSet full_set(roi_case.layers.size());
+        ZImageSet roi_set(roi_case.layers.size());
+        for (size_t m = 0; m < roi_case.layers.size(); ++m)
+        {
+            auto & layer = roi_case.layers[m];
+            full_set.z_images[m] = ZImage(layer.rgba, layer.z.clone(), layer.mode);
+            roi_set.z_images[m] = ZImage(layer.rgba, layer.z, layer.mode, load_roi);
+        }
+        full_set.expand_z(false, radius);
+        roi_set.expand_z(false, radius);
+
+        auto start = std::chrono::steady_clock::now();
+        auto result = roi_set.merge_images(false, {0, 0, 0, 0}, roi - load_roi.tl());
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        cv::Mat_<cv::Vec<uint16_t, 4>> reference = full_set.merge_images(false)(roi);
+
+        int max_error;
+        double mean_error;
+        compare(result, reference, max_error, mean_error);
+        bool ok = (max_error == 0);
+        passed = passed && ok;
+
+        std::cout << std::left << std::setw(16) << "roi expand" << std::setw(16) << ("radius " + std::to_string(radius))
+                  << std::setw(10) << "normal"
+                  << std::right << std::setw(10) << max_error
+                  << std::setw(12) << std::fixed << std::setprecision(4) << mean_error
+                  << std::setw(12) << std::setprecision(2) << roi.area() / 1e6 / seconds.count()
+                  << (ok ? "" : "  FAILED") << std::endl;
+    }
+
+    std::cout << (passed ? "All kernels are within their tolerance." : "Some kernels are out of their tolerance!") << std::endl;
+    return passed;
+}
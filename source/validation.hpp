@@ -0,0 +1,16 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+// Differential validation of the merge kernels. Every kernel variant (storage,
+// accumulator, premultiplied blending, compressed and sparse layers, progressive merge)
+// merges generated layer stacks (random, equal z, binary alpha, single blend
+// modes, depth sorted tiles, more than 255 layers) and is compared with a plain scalar
+// reference: a stable sort of all the layers of every pixel followed by
+// blend_pixel in float. Prints the max/mean error in 16-bit code values and
+// the throughput of every variant, returns false if any error is above the
+// tolerance of its variant. A roi merged with a z-pass expansion is compared
+// with the crop of the full merge. The channels read from PNG headers (gray with alpha,
+// tRNS chunks) are checked against the ones the decoding gives beforehand.
+bool
+validate_kernels(cv::Size size, unsigned seed = 1);
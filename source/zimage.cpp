@@ -1,13 +1,21 @@
 #include "zimage.hpp"
 #include "consts.hpp"
 #include "enums.hpp"
+#include "half.hpp"
+#include "morphology.hpp"
+#include "tile_codec.hpp"
 #include "utilities.hpp"
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <numeric>
 #include <omp.h>
@@ -15,6 +23,9 @@
 #include <string>
 #include <vector>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 // Helper functions
 
 float
@@ -41,51 +52,324 @@ blend_value(float a_value, float b_value, BlendMode mode)
 }
 
 void
-blend_pixel(float a_r, float a_g, float a_b, float a_a, 
-            uint16_t b_r, uint16_t b_g, uint16_t b_b, uint16_t b_a, 
+blend_pixel(cv::Vec<float, 4> a, const cv::Vec<float, 4> & b,
             BlendMode mode, cv::Vec<float, 4> & result)
 {   
     // Early termination in case of black alpha
-    if (b_a == 0)
+    if (b[3] == 0)
     {
-        result = {a_r, a_g, a_b, a_a};
+        result = a;
         return;
     }
 
     // All computations are done in [0.0, 1.0] range
-    float b_r_ = b_r/MAX_16_BIT_VALUE_F;
-    float b_g_ = b_g/MAX_16_BIT_VALUE_F;
-    float b_b_ = b_b/MAX_16_BIT_VALUE_F;
-    float b_a_ = b_a/MAX_16_BIT_VALUE_F;
-
-    float out_alpha = blend_alpha(a_a, b_a_);
+    float out_alpha = blend_alpha(a[3], b[3]);
 
-    result[0] = (1-b_a_/out_alpha)*a_r + (b_a_/out_alpha)*((1-a_a)*b_r_ + a_a*blend_value(a_r, b_r_, mode));
-    result[1] = (1-b_a_/out_alpha)*a_g + (b_a_/out_alpha)*((1-a_a)*b_g_ + a_a*blend_value(a_g, b_g_, mode));
-    result[2] = (1-b_a_/out_alpha)*a_b + (b_a_/out_alpha)*((1-a_a)*b_b_ + a_a*blend_value(a_b, b_b_, mode));
+    result[0] = (1-b[3]/out_alpha)*a[0] + (b[3]/out_alpha)*((1-a[3])*b[0] + a[3]*blend_value(a[0], b[0], mode));
+    result[1] = (1-b[3]/out_alpha)*a[1] + (b[3]/out_alpha)*((1-a[3])*b[1] + a[3]*blend_value(a[1], b[1], mode));
+    result[2] = (1-b[3]/out_alpha)*a[2] + (b[3]/out_alpha)*((1-a[3])*b[2] + a[3]*blend_value(a[2], b[2], mode));
     result[3] = out_alpha;
 }
 
-// ZImage
+cv::Rect
+expansion_roi(cv::Rect roi, cv::Size size, int radius)
+{
+    if (roi.empty())
+        return roi;
+
+    int margin = std::max(1, radius);
+    return cv::Rect(roi.x - margin, roi.y - margin, roi.width + 2 * margin, roi.height + 2 * margin)
+           & cv::Rect(0, 0, size.width, size.height);
+}
+
+inline void
+blend_premultiplied(const cv::Vec<float, 4> & a, const cv::Vec<float, 4> & b,
+                    BlendMode mode, cv::Vec<float, 4> & result)
+{
+    // The straight alpha blending multiplied by the output alpha, the same
+    // expression holds for the colour channels and the alpha.
+    float a_keep = 1 - b[3];
+    float b_keep = 1 - a[3];
+    for (int c = 0; c < 4; ++c)
+    {
+        if (mode == BlendMode::NORMAL)
+            result[c] = b[c] + a_keep*a[c];
+        else if (mode == BlendMode::MULTIPLY)
+            result[c] = a_keep*a[c] + b_keep*b[c] + a[c]*b[c];
+        else
+            result[c] = a[c] + b[c] - a[c]*b[c];
+    }
+}
+
+inline cv::Vec<float, 4>
+premultiply(const cv::Vec<float, 4> & pixel)
+{
+    return {pixel[0]*pixel[3], pixel[1]*pixel[3], pixel[2]*pixel[3], pixel[3]};
+}
+
+inline cv::Vec<float, 4>
+unpremultiply(const cv::Vec<float, 4> & pixel)
+{
+    if (pixel[3] == 0)
+        return pixel;
+    return {pixel[0]/pixel[3], pixel[1]/pixel[3], pixel[2]/pixel[3], pixel[3]};
+}
+
+template <typename T>
+void
+sort_by_key(std::vector<T> & items, std::vector<T> & buffer)
+{
+    // Stable ascending sort on the 16-bit key: an insertion sort for the few
+    // layers of most pixels, two counting passes (LSD radix sort) otherwise.
+    size_t count = items.size();
+    if (count <= INSERTION_SORT_LIMIT)
+    {
+        for (size_t k = 1; k < count; ++k)
+        {
+            T item = items[k];
+            size_t l = k;
+            for (; l > 0 && items[l - 1].key > item.key; --l)
+                items[l] = items[l - 1];
+            items[l] = item;
+        }
+        return;
+    }
+
+    std::array<uint32_t, 256> low_counts = {};
+    std::array<uint32_t, 256> high_counts = {};
+    for (auto & item : items)
+    {
+        ++low_counts[item.key & 0xFF];
+        ++high_counts[item.key >> 8];
+    }
+
+    buffer.resize(count);
+    auto * from = &items;
+    auto * to = &buffer;
+    for (int shift : {0, 8})
+    {
+        // A byte shared by all the keys leaves the order as it is
+        auto & counts = shift ? high_counts : low_counts;
+        if (counts[((*from)[0].key >> shift) & 0xFF] == count)
+            continue;
+
+        uint32_t offset = 0;
+        for (auto & bucket : counts)
+        {
+            uint32_t size = bucket;
+            bucket = offset;
+            offset += size;
+        }
+        for (auto & item : *from)
+            (*to)[counts[(item.key >> shift) & 0xFF]++] = item;
+        std::swap(from, to);
+    }
+
+    if (from != &items)
+        items.swap(buffer);
+}
+
+// Pixel access for the supported storages
+
+inline float
+to_unit(uint8_t value)
+{
+    // The same value the 8 to 16 bit widening (x257) would give
+    return (value * 257)/MAX_16_BIT_VALUE_F;
+}
+
+inline float
+to_unit(uint16_t value)
+{
+    return value/MAX_16_BIT_VALUE_F;
+}
+
+inline float
+to_unit(float value)
+{
+    return value;
+}
+
+template <typename T, int CN>
+cv::Vec<float, 4>
+fetch_pixel(const cv::Mat & mat, int i, int j)
+{
+    // Layers without alpha channel are opaque
+    const T * pixel = mat.ptr<T>(i) + CN * j;
+    return {to_unit(pixel[0]), to_unit(pixel[1]), to_unit(pixel[2]),
+            (CN == 4) ? to_unit(pixel[CN - 1]) : 1.0f};
+}
+
+template <>
+cv::Vec<float, 4>
+fetch_pixel<cv::float16_t, 4>(const cv::Mat & mat, int i, int j)
+{
+    return load_half4(mat.ptr<cv::float16_t>(i) + 4 * j);
+}
+
+FetchFunction
+select_fetch(int type)
+{
+    switch (type)
+    {
+        case CV_8UC3: return fetch_pixel<uint8_t, 3>;
+        case CV_8UC4: return fetch_pixel<uint8_t, 4>;
+        case CV_16UC3: return fetch_pixel<uint16_t, 3>;
+        case CV_16UC4: return fetch_pixel<uint16_t, 4>;
+        case CV_32FC3: return fetch_pixel<float, 3>;
+        case CV_32FC4: return fetch_pixel<float, 4>;
+        case CV_16FC4: return fetch_pixel<cv::float16_t, 4>;
+        default: throw std::runtime_error("Unsupported rgba storage format!");
+    }
+}
 
-ZImage::ZImage(std::string rgba_file_path, std::string z_file_path, BlendMode mode)
-: mode(mode)
+void
+check_colour_format(const cv::Mat & mat)
 {
-    // Reading and checking the rgba-image
-    auto rgba_mat_ = cv::imread(rgba_file_path, cv::IMREAD_UNCHANGED);
-    if (rgba_mat_.depth()!=CV_16U && rgba_mat_.depth()!=CV_8U)
+    if (mat.depth()!=CV_16U && mat.depth()!=CV_8U && mat.depth()!=CV_32F)
     {
-        throw std::runtime_error("Unsupported rgba-image format! Please use 8-bit or 16-bit image.");
+        throw std::runtime_error("Unsupported rgba-image format! Please use 8-bit, 16-bit or float image.");
     }
 
-    if (rgba_mat_.channels()!=3 && rgba_mat_.channels()!=4)
+    if (mat.channels()!=3 && mat.channels()!=4)
     {
         throw std::runtime_error("Unsupported rgba-image format! The image must have 3 (rgb) or 4 (rgba) channels.");
     }
+}
+
+cv::Mat
+to_storage(cv::Mat mat, cv::Rect roi, PixelStorage storage)
+{
+    // Cropping first, then converting the data to the storage format in a single
+    // pass. The native storage keeps the decoded depth and channels, they are
+    // converted while blending.
+    if (!roi.empty())
+        mat = mat(roi).clone();
+
+    double max_value = (mat.depth()==CV_8U) ? MAX_8_BIT_VALUE_F :
+                       (mat.depth()==CV_16U) ? MAX_16_BIT_VALUE_F : 1.0;
+    if (storage == PixelStorage::HALF)
+    {
+        if (mat.channels()==3)
+            cv::cvtColor(mat, mat, cv::COLOR_BGR2BGRA);
+        mat.convertTo(mat, CV_16F, 1.0/max_value);
+    }
+    else if (storage == PixelStorage::UINT16)
+    {
+        if (mat.channels()==3)
+            cv::cvtColor(mat, mat, cv::COLOR_BGR2BGRA);
+        if (mat.depth()!=CV_16U)
+            mat.convertTo(mat, CV_16U, MAX_16_BIT_VALUE_F/max_value);
+    }
+
+    return mat;
+}
+
+// Merge accumulator pixels, the blending itself is always done in float
+
+inline cv::Vec<float, 4>
+load_pixel(const cv::Vec<float, 4> & pixel)
+{
+    return pixel;
+}
+
+inline cv::Vec<float, 4>
+load_pixel(const cv::Vec<cv::float16_t, 4> & pixel)
+{
+    return load_half4(pixel.val);
+}
+
+inline void
+store_pixel(const cv::Vec<float, 4> & value, cv::Vec<float, 4> & pixel)
+{
+    pixel = value;
+}
+
+inline void
+store_pixel(const cv::Vec<float, 4> & value, cv::Vec<cv::float16_t, 4> & pixel)
+{
+    store_half4(value, pixel.val);
+}
+
+template <typename AccT>
+void
+unpremultiply_image(cv::Mat_<cv::Vec<AccT, 4>> & image)
+{
+    #pragma omp parallel for
+    for (int i = 0; i < image.rows; ++i)
+    {
+        cv::Vec<AccT, 4> * row = image[i];
+        for (int j = 0; j < image.cols; ++j)
+            store_pixel(unpremultiply(load_pixel(row[j])), row[j]);
+    }
+}
+
+// ZImage
+
+struct ZImage::CompressedTiles
+{
+    uint64_t id;
+    int rgba_type;
+    int tile_cols;
+    std::vector<uint8_t> data;
+    std::vector<size_t> rgba_offsets;
+    std::vector<size_t> z_offsets;
+
+    // The encoded tiles: 'data' or the mapping of a spilled scratch file
+    const uint8_t * bytes = nullptr;
+    void * mapping = nullptr;
+    size_t mapping_size = 0;
+
+    ~CompressedTiles()
+    {
+        if (mapping)
+            munmap(mapping, mapping_size);
+    }
+};
+
+struct ZImage::CachedTile
+{
+    uint64_t id = 0;
+    int index = -1;
+    cv::Mat rgba;
+    cv::Mat z;
+};
+
+struct ZImage::SparseRuns
+{
+    // Columns [start, end) of a run, 'offset' is the index of its first pixel
+    struct Run
+    {
+        int start;
+        int end;
+        int offset;
+    };
+
+    // The runs of row i are runs[row_runs[i]] to runs[row_runs[i + 1] - 1]
+    std::vector<int> row_runs;
+    std::vector<Run> runs;
+
+    // Pixels of all the runs in a single row each, rgba in the storage format
+    cv::Mat rgba;
+    cv::Mat_<uint16_t> z;
+};
 
-    // Reading and checking the z-image
-    auto z_mat_ = cv::imread(z_file_path, cv::IMREAD_UNCHANGED);
+ZImage::ZImage(std::string rgba_file_path, std::string z_file_path, BlendMode mode,
+               cv::Rect roi, PixelStorage storage)
+: ZImage(cv::imread(rgba_file_path, cv::IMREAD_UNCHANGED),
+         cv::imread(z_file_path, cv::IMREAD_UNCHANGED),
+         mode, roi, storage)
+{
+}
+
+ZImage::ZImage(cv::Mat rgba_mat_, cv::Mat z_mat_, BlendMode mode,
+               cv::Rect roi, PixelStorage storage)
+: mode(mode), storage(storage)
+{
+    // Checking the rgba-image
+    check_colour_format(rgba_mat_);
 
+    // Checking the z-image
     if (z_mat_.channels()!=1)
     {
         throw std::runtime_error("Unsupported depth-image format! Please use grayscale images.");
@@ -104,133 +388,1267 @@ ZImage::ZImage(std::string rgba_file_path, std::string z_file_path, BlendMode mo
         throw std::runtime_error(message);
     }
 
-    // Converting the data to 16 bit rgba if necessary.
-    if (rgba_mat_.depth()==CV_8U)
-        rgba_mat_.convertTo(rgba_mat_, CV_16U, MAX_16_BIT_VALUE_F/MAX_8_BIT_VALUE_F);
-    if (rgba_mat_.channels()==3)
-        cv::cvtColor(rgba_mat_, rgba_mat_, cv::COLOR_BGR2BGRA);
+    // Cropping to the region of interest before any conversion,
+    // so the following passes only touch the needed pixels.
+    if (!roi.empty())
+    {
+        if ((roi & cv::Rect(0, 0, rgba_mat_.cols, rgba_mat_.rows)) != roi)
+        {
+            throw std::runtime_error("Region of interest is out of the image bounds!");
+        }
+        z_mat_ = z_mat_(roi).clone();
+    }
+
+    full_size = rgba_mat_.size();
+    rgba_mat_ = to_storage(rgba_mat_, roi, storage);
+    fetch_rgba = select_fetch(rgba_mat_.type());
 
     // Saving the member variables
-    rgba_mat = cv::Mat_<cv::Vec<uint16_t, 4>>(rgba_mat_);
+    rgba_mat = rgba_mat_;
     z_mat = cv::Mat_<cv::Vec<uint16_t, 1>>(z_mat_);
     height = rgba_mat.rows;
     width = rgba_mat.cols;
-}
 
-uint16_t& 
-ZImage::get_r(int i, int j)
-{
-    return rgba_mat(i, j)[0];
+    compute_z_bounds();
 }
 
-uint16_t& 
-ZImage::get_g(int i, int j)
+void
+ZImage::add_aov(cv::Mat aov_mat, cv::Rect roi)
 {
-    return rgba_mat(i, j)[1];
+    if (tiles)
+        throw std::runtime_error("Colour AOVs can't be added to compressed layers!");
+
+    // A layer without the AOV is transparent in it
+    if (!aov_mat.empty())
+    {
+        check_colour_format(aov_mat);
+        if (aov_mat.size() != full_size)
+            throw std::runtime_error("Error, resolution missmatch found! Colour AOVs must have the same resolution as the RGBA-image.");
+        aov_mat = to_storage(aov_mat, roi, storage);
+    }
+
+    aov_mats.push_back(aov_mat);
+    fetch_aovs.push_back(aov_mat.empty() ? nullptr : select_fetch(aov_mat.type()));
 }
 
-uint16_t& 
-ZImage::get_b(int i, int j)
+cv::Vec<float, 4>
+ZImage::get_aov(size_t k, int i, int j)
 {
-    return rgba_mat(i, j)[2];
+    if (!fetch_aovs[k])
+        return cv::Vec<float, 4>(0, 0, 0, 0);
+
+    return fetch_aovs[k](aov_mats[k], i, j);
 }
 
-uint16_t& 
-ZImage::get_a(int i, int j)
+cv::Vec<float, 4>
+ZImage::get_rgba(int i, int j)
 {
-    return rgba_mat(i, j)[3];
+    if (tiles)
+        return fetch_rgba(cached_tile(i, j).rgba, i % Z_TILE_SIZE, j % Z_TILE_SIZE);
+
+    if (runs)
+    {
+        int index = sparse_index(i, j);
+        return (index < 0) ? cv::Vec<float, 4>(0, 0, 0, 0) : fetch_rgba(runs->rgba, 0, index);
+    }
+
+    return fetch_rgba(rgba_mat, i, j);
 }
 
-uint16_t& 
+uint16_t
 ZImage::get_z(int i, int j)
 {
+    if (tiles)
+        return cached_tile(i, j).z.ptr<uint16_t>(i % Z_TILE_SIZE)[j % Z_TILE_SIZE];
+
+    if (runs)
+    {
+        int index = sparse_index(i, j);
+        return (index < 0) ? 0 : runs->z(0, index);
+    }
+
     return z_mat(i, j)[0];
 }
 
+int
+ZImage::first_run(int i, int j)
+{
+    if (!runs)
+        return 0;
+
+    // The first run of the row ending after column j
+    auto first = runs->runs.begin() + runs->row_runs[i];
+    auto last = runs->runs.begin() + runs->row_runs[i + 1];
+    return std::upper_bound(first, last, j, [](int j, const SparseRuns::Run & run) { return j < run.end; })
+           - runs->runs.begin();
+}
+
+template <FetchFunction Fetch>
+inline FetchFunction
+layer_fetch(FetchFunction)
+{
+    return Fetch;
+}
+
+template <>
+inline FetchFunction
+layer_fetch<nullptr>(FetchFunction own)
+{
+    return own;
+}
+
+template <FetchFunction Fetch>
+cv::Vec<float, 4>
+ZImage::get_rgba(int i, int j, int & run)
+{
+    auto fetch = layer_fetch<Fetch>(fetch_rgba);
+    if (tiles)
+        return fetch(cached_tile(i, j).rgba, i % Z_TILE_SIZE, j % Z_TILE_SIZE);
+
+    if (!runs)
+        return fetch(rgba_mat, i, j);
+
+    int last = runs->row_runs[i + 1];
+    while (run < last && runs->runs[run].end <= j)
+        ++run;
+    if (run == last || j < runs->runs[run].start)
+        return cv::Vec<float, 4>(0, 0, 0, 0);
+
+    return fetch(runs->rgba, 0, runs->runs[run].offset + j - runs->runs[run].start);
+}
+
+uint16_t
+ZImage::get_z(int i, int j, int run)
+{
+    if (!runs)
+        return get_z(i, j);
+
+    return runs->z(0, runs->runs[run].offset + j - runs->runs[run].start);
+}
+
+int
+ZImage::rgba_type()
+{
+    if (tiles)
+        return tiles->rgba_type;
+
+    return runs ? runs->rgba.type() : rgba_mat.type();
+}
+
+int
+ZImage::next_visible(int i, int j, int & run)
+{
+    int last = runs->row_runs[i + 1];
+    while (run < last && runs->runs[run].end <= j)
+        ++run;
+
+    return (run == last) ? width : std::max(j, runs->runs[run].start);
+}
+
 BlendMode
 ZImage::get_m(int i, int j)
 {
     return mode;
 }
 
-// ZImageSet
+void
+ZImage::expand_z(bool inverted_z, int radius)
+{
+    if (tiles || runs)
+        throw std::runtime_error("The z-pass of compressed or sparse layers can't be expanded!");
 
-bool
-ZImageSet::resolution_check()
+    if (radius > 0)
+    {
+        square_min_max(z_mat, radius, inverted_z);
+        compute_z_bounds();
+        return;
+    }
+
+    auto ellipse_kernel = cv::getStructuringElement(
+        cv::MorphShapes::MORPH_ELLIPSE, cv::Size(2, 2));
+
+    if (inverted_z)
+        cv::erode(z_mat, z_mat, ellipse_kernel);
+    else
+        cv::dilate(z_mat, z_mat, ellipse_kernel);
+
+    compute_z_bounds();
+}
+
+void
+ZImage::compute_z_bounds()
 {
-    for (unsigned short i = 0; i < z_images.size() - 1; ++i)
+    int tile_rows = (height + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+    int tile_cols = (width + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+    z_tile_min = cv::Mat_<uint16_t>(tile_rows, tile_cols, MAX_16_BIT_VALUE);
+    z_tile_max = cv::Mat_<uint16_t>(tile_rows, tile_cols, uint16_t(0));
+    visible_pixels = 0;
+
+    for (int i = 0; i < height; ++i)
     {
-        if ((z_images[i].height != z_images[i + 1].height) ||
-            (z_images[i].width != z_images[i + 1].width))
+        uint16_t * min_row = z_tile_min[i / Z_TILE_SIZE];
+        uint16_t * max_row = z_tile_max[i / Z_TILE_SIZE];
+        for (int j = 0; j < width; ++j)
         {
-            return false;
+            if (get_rgba(i, j)[3] == 0)
+                continue;
+            ++visible_pixels;
+            uint16_t z = get_z(i, j);
+            min_row[j / Z_TILE_SIZE] = std::min(min_row[j / Z_TILE_SIZE], z);
+            max_row[j / Z_TILE_SIZE] = std::max(max_row[j / Z_TILE_SIZE], z);
         }
     }
-
-    return true;
 }
 
-ZImageSet::ZImageSet(unsigned short images_count)
+void
+ZImage::compute_tile_hashes()
 {
-    z_images.resize(images_count);
+    if (tiles || runs)
+        throw std::runtime_error("The tiles of compressed or sparse layers can't be hashed!");
+
+    int tile_rows = (height + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+    int tile_cols = (width + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+    tile_hashes.assign(tile_rows * tile_cols, 0);
+
+    // The same pixels in another storage or blend mode give another tile
+    uint64_t seed = (static_cast<uint64_t>(mode) << 32) | static_cast<uint64_t>(rgba_mat.type());
+    size_t rgba_pixel = rgba_mat.elemSize();
+    size_t z_pixel = z_mat.elemSize();
+
+    for (int tile_i = 0; tile_i < tile_rows; ++tile_i)
+    {
+        for (int tile_j = 0; tile_j < tile_cols; ++tile_j)
+        {
+            int x = tile_j * Z_TILE_SIZE;
+            int tile_width = std::min<int>(Z_TILE_SIZE, width - x);
+            uint64_t hash = seed;
+            for (int i = tile_i * Z_TILE_SIZE; i < std::min<int>(height, (tile_i + 1) * Z_TILE_SIZE); ++i)
+            {
+                hash = hash_bytes(rgba_mat.ptr(i) + x * rgba_pixel, tile_width * rgba_pixel, hash);
+                hash = hash_bytes(z_mat.ptr(i) + x * z_pixel, tile_width * z_pixel, hash);
+                for (auto & aov_mat : aov_mats)
+                {
+                    if (!aov_mat.empty())
+                        hash = hash_bytes(aov_mat.ptr(i) + x * aov_mat.elemSize(), tile_width * aov_mat.elemSize(), hash);
+                }
+            }
+            tile_hashes[tile_i * tile_cols + tile_j] = hash;
+        }
+    }
 }
 
-cv::Mat_<cv::Vec<uint16_t, 4>>
-ZImageSet::merge_images(bool invert_z, cv::Vec<float, 4> background={0, 0, 0, 0})
+void
+ZImage::compress()
 {
-    int height = z_images[0].height;
-    int width = z_images[0].width;
-    cv::Mat_<cv::Vec<float, 4>> result(height, width, background);
+    if (tiles || runs)
+        return;
 
-    #pragma omp parallel for
-    for (int i = 0; i<height; ++i)
-    {
-        std::vector<unsigned char> sorting_vector(z_images.size());
-        std::vector<uint16_t> zvalues(z_images.size());
+    // Every compressed layer gets its own id, so the cache never mixes up
+    // the tiles of a destroyed layer with the ones of a new layer.
+    static std::atomic<uint64_t> next_id(1);
+
+    auto compressed = std::make_shared<CompressedTiles>();
+    compressed->id = next_id++;
+    compressed->rgba_type = rgba_mat.type();
+    compressed->tile_cols = (width + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
 
-        for (int j = 0; j<width; ++j)
+    for (int y = 0; y < height; y += Z_TILE_SIZE)
+    {
+        for (int x = 0; x < width; x += Z_TILE_SIZE)
         {
-            // Reset the sorting vector to preserve the order of images
-            std::iota(sorting_vector.begin(), sorting_vector.end(), 0);
+            cv::Rect tile(x, y, std::min<int>(Z_TILE_SIZE, width - x), std::min<int>(Z_TILE_SIZE, height - y));
+            compressed->rgba_offsets.push_back(compressed->data.size());
+            encode_tile(rgba_mat(tile), compressed->data);
+            compressed->z_offsets.push_back(compressed->data.size());
+            encode_tile(z_mat(tile), compressed->data);
+        }
+    }
+    compressed->data.shrink_to_fit();
+    compressed->bytes = compressed->data.data();
 
-            // Collect the z-values
-            for (unsigned char m = 0; m < z_images.size(); ++m)
-            {
-                zvalues[m] = z_images[m].get_z(i, j);
-            }
+    tiles = compressed;
+    rgba_mat.release();
+    z_mat.release();
+}
+
+void
+ZImage::spill(std::string scratch_dir)
+{
+    compress();
+    if (!tiles || tiles->mapping)
+        return;
 
-            if (invert_z)
-                std::stable_sort(sorting_vector.begin(), sorting_vector.end(),
-                                 [&zvalues](unsigned char a, unsigned char b) { return zvalues[a] > zvalues[b]; });
-            else
-                std::stable_sort(sorting_vector.begin(), sorting_vector.end(),
-                                 [&zvalues](unsigned char a, unsigned char b) { return zvalues[a] < zvalues[b]; });
+    // The file is unlinked right away, the mapping keeps it alive
+    auto file_path = scratch_dir + "/zmerger_layer_XXXXXX";
+    int fd = mkstemp(&file_path[0]);
+    if (fd < 0)
+        throw std::runtime_error("Can't create a scratch file in " + scratch_dir + ": " + std::strerror(errno));
+    unlink(file_path.c_str());
 
-            // // Blend the images
-            for (auto k : sorting_vector)
-            {
-                blend_pixel(result(i, j)[0], result(i, j)[1], result(i, j)[2], result(i, j)[3],
-                            z_images[k].get_r(i, j), z_images[k].get_g(i, j), z_images[k].get_b(i, j), z_images[k].get_a(i, j),
-                            z_images[k].get_m(i, j), result(i, j));
-            }
+    auto & data = tiles->data;
+    size_t written = 0;
+    while (written < data.size())
+    {
+        auto count = write(fd, data.data() + written, data.size() - written);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            close(fd);
+            throw std::runtime_error("Can't write the scratch file in " + scratch_dir + ": " + std::strerror(errno));
         }
+        written += count;
     }
 
-    return cv::Mat_<cv::Vec<uint16_t, 4>>(result*MAX_16_BIT_VALUE);
+    void * mapping = data.empty() ? nullptr : mmap(nullptr, data.size(), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Can't map the scratch file in " + scratch_dir + ": " + std::strerror(errno));
+
+    auto spilled = std::make_shared<CompressedTiles>();
+    spilled->id = tiles->id;
+    spilled->rgba_type = tiles->rgba_type;
+    spilled->tile_cols = tiles->tile_cols;
+    spilled->rgba_offsets = tiles->rgba_offsets;
+    spilled->z_offsets = tiles->z_offsets;
+    spilled->bytes = static_cast<const uint8_t *>(mapping);
+    spilled->mapping = mapping;
+    spilled->mapping_size = data.size();
+    tiles = spilled;
+}
+
+float
+ZImage::coverage()
+{
+    return (width * height > 0) ? float(visible_pixels) / (width * height) : 0.0f;
 }
 
 void
-ZImageSet::expand_z(bool inverted_z)
+ZImage::make_sparse(float max_coverage)
 {
-    auto ellipse_kernel = cv::getStructuringElement(
-        cv::MorphShapes::MORPH_ELLIPSE, cv::Size(2, 2));
-    
-    #pragma omp parallel for
-    for (int i = 0; i < z_images.size(); ++i)
+    if (tiles || runs || coverage() > max_coverage)
+        return;
+
+    auto sparse = std::make_shared<SparseRuns>();
+    sparse->row_runs.reserve(height + 1);
+    int offset = 0;
+    for (int i = 0; i < height; ++i)
     {
-        if (inverted_z)
-            cv::erode(z_images[i].z_mat, z_images[i].z_mat, ellipse_kernel);
-        else
-            cv::dilate(z_images[i].z_mat, z_images[i].z_mat, ellipse_kernel);
+        sparse->row_runs.push_back(sparse->runs.size());
+        for (int j = 0; j < width; ++j)
+        {
+            if (get_rgba(i, j)[3] == 0)
+                continue;
+            int start = j;
+            while (j < width && get_rgba(i, j)[3] != 0)
+                ++j;
+            sparse->runs.push_back({start, j, offset});
+            offset += j - start;
+        }
+    }
+    sparse->row_runs.push_back(sparse->runs.size());
+
+    // Packing the pixels of the runs, row after row
+    size_t rgba_pixel = rgba_mat.elemSize();
+    sparse->rgba.create(1, offset, rgba_mat.type());
+    sparse->z.create(1, offset);
+    for (int i = 0; i < height; ++i)
+    {
+        for (int k = sparse->row_runs[i]; k < sparse->row_runs[i + 1]; ++k)
+        {
+            auto & run = sparse->runs[k];
+            std::memcpy(sparse->rgba.ptr(0) + run.offset * rgba_pixel, rgba_mat.ptr(i) + run.start * rgba_pixel,
+                        (run.end - run.start) * rgba_pixel);
+            std::memcpy(sparse->z[0] + run.offset, z_mat.ptr<uint16_t>(i) + run.start,
+                        (run.end - run.start) * sizeof(uint16_t));
+        }
+    }
+    sparse->runs.shrink_to_fit();
+
+    runs = sparse;
+    rgba_mat.release();
+    z_mat.release();
+}
+
+void
+ZImage::set_cache_layer(int layer, size_t slots)
+{
+    cache_layer = layer;
+    cache_slots = slots;
+}
+
+bool
+ZImage::is_compressed()
+{
+    return tiles != nullptr;
+}
+
+bool
+ZImage::is_sparse()
+{
+    return runs != nullptr;
+}
+
+size_t
+ZImage::memory_size()
+{
+    size_t aovs_size = 0;
+    for (auto & aov_mat : aov_mats)
+        aovs_size += aov_mat.total() * aov_mat.elemSize();
+
+    if (tiles)
+        return tiles->data.size() + 2 * tiles->rgba_offsets.size() * sizeof(size_t) + aovs_size;
+
+    if (runs)
+        return runs->rgba.total() * runs->rgba.elemSize() + runs->z.total() * sizeof(uint16_t)
+               + runs->runs.size() * sizeof(SparseRuns::Run) + runs->row_runs.size() * sizeof(int) + aovs_size;
+
+    return rgba_mat.total() * rgba_mat.elemSize() + z_mat.total() * z_mat.elemSize() + aovs_size;
+}
+
+ZImage::CachedTile &
+ZImage::cached_tile(int i, int j)
+{
+    // Direct mapped per-thread cache, grown to the slots of the set and freed after
+    // each merge. The slots of one tile of the layers of a set don't collide: the
+    // layers are numbered from 0, the multiplier is odd and the slots are a power
+    // of 2 above the layer count.
+    auto & cache = tile_cache();
+    if (cache.size() < cache_slots)
+        cache.resize(cache_slots);
+
+    int tile_i = i / Z_TILE_SIZE;
+    int tile_j = j / Z_TILE_SIZE;
+    int index = tile_i * tiles->tile_cols + tile_j;
+    auto & cached = cache[(cache_layer * 131 + index) % cache.size()];
+    if (cached.id == tiles->id && cached.index == index)
+        return cached;
+
+    int tile_height = std::min<int>(Z_TILE_SIZE, height - tile_i * Z_TILE_SIZE);
+    int tile_width = std::min<int>(Z_TILE_SIZE, width - tile_j * Z_TILE_SIZE);
+    cached.rgba.create(tile_height, tile_width, tiles->rgba_type);
+    cached.z.create(tile_height, tile_width, CV_16UC1);
+    decode_tile(tiles->bytes + tiles->rgba_offsets[index], cached.rgba);
+    decode_tile(tiles->bytes + tiles->z_offsets[index], cached.z);
+    cached.id = tiles->id;
+    cached.index = index;
+
+    return cached;
+}
+
+std::vector<ZImage::CachedTile> &
+ZImage::tile_cache()
+{
+    thread_local std::vector<CachedTile> cache;
+    return cache;
+}
+
+void
+ZImage::release_tile_cache()
+{
+    std::vector<CachedTile>().swap(tile_cache());
+}
+
+int
+ZImage::sparse_index(int i, int j)
+{
+    // The last run starting at or before column j
+    auto first = runs->runs.begin() + runs->row_runs[i];
+    auto last = runs->runs.begin() + runs->row_runs[i + 1];
+    auto run = std::upper_bound(first, last, j, [](int j, const SparseRuns::Run & run) { return j < run.start; });
+    if (run == first || j >= (--run)->end)
+        return -1;
+
+    return run->offset + j - run->start;
+}
+
+// ZImageSet
+
+cv::Rect
+ZImageSet::load_layers(cv::Rect roi, bool expand_z, int expand_radius,
+                       const std::function<cv::Size()> & frame_size,
+                       const std::function<void(int, cv::Rect)> & load,
+                       std::vector<std::string> & errors)
+{
+    // With a z-pass expansion the roi is loaded with the pixels around it the
+    // expansion reads, then only the roi is merged, as in a crop of a full merge
+    cv::Rect load_roi = roi;
+    cv::Rect merge_roi;
+    if (expand_z && !roi.empty())
+    {
+        load_roi = expansion_roi(roi, frame_size(), expand_radius);
+        merge_roi = roi - load_roi.tl();
+    }
+
+    std::atomic<bool> failed(false);
+    int images_count = z_images.size();
+    #pragma omp parallel for
+    for (int k = 0; k < images_count; ++k)
+    {
+        if (failed)
+            continue;
+
+        try
+        {
+            load(k, load_roi);
+        }
+        catch (const std::exception & e)
+        {
+            #pragma omp critical(load_error)
+            errors.push_back(e.what());
+            failed = true;
+        }
+    }
+
+    return merge_roi;
+}
+
+bool
+ZImageSet::resolution_check()
+{
+    // The layers loaded with a roi have the same cropped size, their full sizes are compared too
+    for (size_t i = 0; i + 1 < z_images.size(); ++i)
+    {
+        if ((z_images[i].height != z_images[i + 1].height) ||
+            (z_images[i].width != z_images[i + 1].width) ||
+            (z_images[i].full_size != z_images[i + 1].full_size))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+ZImageSet::ZImageSet(size_t images_count)
+{
+    if (images_count > MAX_LAYERS)
+        throw std::runtime_error("Too many layers! At most " + std::to_string(MAX_LAYERS) + " layers can be merged.");
+
+    z_images.resize(images_count);
+}
+
+cv::Rect
+ZImageSet::frame_roi(cv::Rect roi)
+{
+    // An empty roi means the whole frame. Merged results have the size of the roi,
+    // pixel (i, j) of a result corresponds to (roi.y + i, roi.x + j) of the layers.
+    cv::Rect frame(0, 0, z_images[0].width, z_images[0].height);
+    if (roi.empty())
+        roi = frame;
+    if ((roi & frame) != roi)
+        throw std::runtime_error("Region of interest is out of the image bounds!");
+
+    return roi;
+}
+
+void
+ZImageSet::number_cache_layers()
+{
+    size_t slots = TILE_CACHE_SLOTS;
+    while (slots < 2 * z_images.size())
+        slots *= 2;
+
+    for (size_t m = 0; m < z_images.size(); ++m)
+        z_images[m].set_cache_layer(m, slots);
+}
+
+void
+ZImageSet::init_aovs(MergeAOVs * aovs, cv::Rect roi)
+{
+    if (!aovs)
+        return;
+
+    aovs->depth.create(roi.height, roi.width);
+    aovs->front_layer.create(roi.height, roi.width);
+    aovs->coverage.create(roi.height, roi.width);
+}
+
+void
+ZImageSet::store_aov(MergeAOVs * aovs, int i, int j, int result_i, int result_j,
+                     const PixelAOV & aov, bool invert_z)
+{
+    if (aov.front_layer < 0)
+    {
+        aovs->depth(result_i, result_j) = invert_z ? MAX_16_BIT_VALUE : 0;
+        aovs->front_layer(result_i, result_j) = NO_LAYER;
+    }
+    else
+    {
+        aovs->depth(result_i, result_j) = z_images[aov.front_layer].get_z(i, j);
+        aovs->front_layer(result_i, result_j) = aov.front_layer;
+    }
+    aovs->coverage(result_i, result_j) = aov.coverage;
+}
+
+bool
+ZImageSet::tile_order(int tile_i, int tile_j, bool invert_z, std::vector<LayerIndex> & order)
+{
+    // Collects the layers with visible pixels in the tile. Returns true if their
+    // depth ranges do not interleave, then 'order' is the blending order of every
+    // pixel in the tile (the same one the per-pixel stable sort would give).
+    order.clear();
+    for (size_t m = 0; m < z_images.size(); ++m)
+    {
+        if (z_images[m].z_tile_min(tile_i, tile_j) <= z_images[m].z_tile_max(tile_i, tile_j))
+            order.push_back(m);
+    }
+
+    auto min_z = [&](LayerIndex m) { return z_images[m].z_tile_min(tile_i, tile_j); };
+    auto max_z = [&](LayerIndex m) { return z_images[m].z_tile_max(tile_i, tile_j); };
+
+    if (invert_z)
+        std::stable_sort(order.begin(), order.end(),
+                         [&](LayerIndex a, LayerIndex b) { return max_z(a) > max_z(b); });
+    else
+        std::stable_sort(order.begin(), order.end(),
+                         [&](LayerIndex a, LayerIndex b) { return min_z(a) < min_z(b); });
+
+    // Equal bounds only keep the order if the stable sort would keep it as well
+    for (size_t k = 1; k < order.size(); ++k)
+    {
+        auto a = order[k - 1];
+        auto b = order[k];
+        uint16_t a_far = invert_z ? min_z(a) : max_z(a);
+        uint16_t b_near = invert_z ? max_z(b) : min_z(b);
+        bool separated = invert_z ? (a_far > b_near) : (a_far < b_near);
+        if (!separated && !(a_far == b_near && a < b))
+        {
+            // The per-pixel sort expects the layers in their original order
+            std::sort(order.begin(), order.end());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+ZImageSet::blend_layer(cv::Vec<float, 4> & pixel, const cv::Vec<float, 4> & rgba, BlendMode mode)
+{
+    if (premultiplied)
+        blend_premultiplied(pixel, premultiply(rgba), mode, pixel);
+    else
+        blend_pixel(pixel, rgba, mode, pixel);
+}
+
+void
+ZImageSet::start_row(int i, int j, const std::vector<LayerIndex> & layers, PixelScratch & scratch)
+{
+    scratch.runs.resize(layers.size());
+    for (size_t k = 0; k < layers.size(); ++k)
+        scratch.runs[k] = z_images[layers[k]].first_run(i, j);
+}
+
+int
+ZImageSet::next_visible(int i, int j, const std::vector<LayerIndex> & layers, PixelScratch & scratch)
+{
+    int next = z_images[0].width;
+    for (size_t k = 0; k < layers.size(); ++k)
+        next = std::min(next, z_images[layers[k]].next_visible(i, j, scratch.runs[k]));
+
+    return next;
+}
+
+bool
+ZImageSet::all_sparse(const std::vector<LayerIndex> & layers)
+{
+    for (auto m : layers)
+    {
+        if (!z_images[m].is_sparse())
+            return false;
+    }
+    return true;
+}
+
+int
+ZImageSet::colour_type()
+{
+    int type = z_images[0].rgba_type();
+    for (auto & z_image : z_images)
+    {
+        if (z_image.rgba_type() != type)
+            return -1;
+    }
+    return type;
+}
+
+template <FetchFunction Fetch>
+void
+ZImageSet::gather_pixel(int i, int j, bool invert_z, const std::vector<LayerIndex> & layers,
+                        PixelScratch & scratch, bool ordered)
+{
+    // Only the visible pixels are sorted, blending a transparent pixel changes
+    // nothing. The sort key puts the back-most layer first.
+    auto & samples = scratch.samples;
+    samples.clear();
+    for (size_t k = 0; k < layers.size(); ++k)
+    {
+        auto m = layers[k];
+        auto rgba = z_images[m].get_rgba<Fetch>(i, j, scratch.runs[k]);
+        if (rgba[3] == 0)
+            continue;
+
+        uint16_t z = z_images[m].get_z(i, j, scratch.runs[k]);
+        samples.push_back({invert_z ? static_cast<uint16_t>(MAX_16_BIT_VALUE - z) : z, m, rgba});
+    }
+
+    if (!ordered)
+        sort_by_key(samples, scratch.buffer);
+}
+
+template <FetchFunction Fetch>
+void
+ZImageSet::merge_pixel(int i, int j, bool invert_z,
+                       const std::vector<LayerIndex> & layers,
+                       PixelScratch & scratch,
+                       cv::Vec<float, 4> & pixel,
+                       PixelAOV * aov)
+{
+    gather_pixel<Fetch>(i, j, invert_z, layers, scratch, false);
+    for (auto & sample : scratch.samples)
+    {
+        if (aov)
+        {
+            aov->front_layer = sample.layer;
+            ++aov->coverage;
+        }
+        blend_layer(pixel, sample.rgba, z_images[sample.layer].get_m(i, j));
+    }
+}
+
+template <FetchFunction Fetch>
+void
+ZImageSet::blend_ordered(int i, int j, const std::vector<LayerIndex> & order, PixelScratch & scratch,
+                         cv::Vec<float, 4> & pixel, PixelAOV * aov)
+{
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        auto m = order[k];
+        auto rgba = z_images[m].get_rgba<Fetch>(i, j, scratch.runs[k]);
+        if (aov && rgba[3] > 0)
+        {
+            aov->front_layer = m;
+            ++aov->coverage;
+        }
+        blend_layer(pixel, rgba, z_images[m].get_m(i, j));
+    }
+}
+
+std::vector<uint64_t>
+ZImageSet::frame_tile_hashes(bool invert_z, const cv::Vec<float, 4> & background)
+{
+    size_t tiles_count = z_images[0].tile_hashes.size();
+    for (auto & z_image : z_images)
+    {
+        if (z_image.tile_hashes.empty() || z_image.tile_hashes.size() != tiles_count)
+            return std::vector<uint64_t>();
+    }
+
+    // Everything else the merged pixels depend on
+    uint64_t settings[] = {z_images.size(), invert_z, half_accumulator, premultiplied, premultiplied_output};
+    uint64_t seed = hash_bytes(settings, sizeof(settings));
+    seed = hash_bytes(background.val, sizeof(background.val), seed);
+
+    std::vector<uint64_t> hashes(tiles_count, seed);
+    for (size_t t = 0; t < tiles_count; ++t)
+    {
+        for (auto & z_image : z_images)
+            hashes[t] = hash_bytes(&z_image.tile_hashes[t], sizeof(uint64_t), hashes[t]);
+    }
+
+    return hashes;
+}
+
+std::vector<bool>
+ZImageSet::find_reused_tiles(const std::vector<uint64_t> & hashes, cv::Rect roi, MergeAOVs * aovs)
+{
+    // Nothing is reused unless the previous frame was merged the same way
+    auto & previous = *tile_reuse;
+    if (hashes.empty() || previous.tile_hashes.size() != hashes.size() || previous.roi != roi ||
+        (aovs && previous.aovs.depth.empty()))
+        return std::vector<bool>();
+
+    std::vector<bool> reused_tiles(hashes.size());
+    for (size_t t = 0; t < hashes.size(); ++t)
+        reused_tiles[t] = (hashes[t] == previous.tile_hashes[t]);
+
+    return reused_tiles;
+}
+
+void
+ZImageSet::reuse_tiles(cv::Mat_<cv::Vec<uint16_t, 4>> & result, cv::Rect roi, MergeAOVs * aovs,
+                       const std::vector<uint64_t> & hashes, const std::vector<bool> & reused_tiles)
+{
+    // Copies the reused tiles from the previous result, then keeps this one
+    auto & previous = *tile_reuse;
+    int tile_cols = (z_images[0].width + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+    int first_tile_i = roi.y / Z_TILE_SIZE;
+    int first_tile_j = roi.x / Z_TILE_SIZE;
+    int last_tile_i = (roi.y + roi.height - 1) / Z_TILE_SIZE;
+    int last_tile_j = (roi.x + roi.width - 1) / Z_TILE_SIZE;
+
+    size_t reused = 0;
+    size_t merged = 0;
+    for (int tile_i = first_tile_i; tile_i <= last_tile_i; ++tile_i)
+    {
+        for (int tile_j = first_tile_j; tile_j <= last_tile_j; ++tile_j)
+        {
+            if (reused_tiles.empty() || !reused_tiles[tile_i * tile_cols + tile_j])
+            {
+                ++merged;
+                continue;
+            }
+
+            auto tile = roi & cv::Rect(tile_j * Z_TILE_SIZE, tile_i * Z_TILE_SIZE, Z_TILE_SIZE, Z_TILE_SIZE);
+            tile -= roi.tl();
+            previous.result(tile).copyTo(result(tile));
+            if (aovs)
+            {
+                previous.aovs.depth(tile).copyTo(aovs->depth(tile));
+                previous.aovs.front_layer(tile).copyTo(aovs->front_layer(tile));
+                previous.aovs.coverage(tile).copyTo(aovs->coverage(tile));
+            }
+            ++reused;
+        }
+    }
+    previous.tiles_reused += reused;
+    previous.tiles_merged += merged;
+
+    previous.tile_hashes = hashes;
+    previous.result = result.clone();
+    previous.roi = roi;
+    previous.aovs = MergeAOVs();
+    if (aovs)
+    {
+        previous.aovs.depth = aovs->depth.clone();
+        previous.aovs.front_layer = aovs->front_layer.clone();
+        previous.aovs.coverage = aovs->coverage.clone();
+    }
+}
+
+template <typename AccT, FetchFunction Fetch>
+void
+ZImageSet::merge_tiles(cv::Mat_<cv::Vec<AccT, 4>> & result, cv::Rect roi, bool invert_z, MergeAOVs * aovs,
+                       const std::vector<bool> & reused_tiles)
+{
+    // The merge goes tile by tile: where the layer depth ranges of a tile are
+    // strictly ordered the blending order is found once for the whole tile,
+    // only the remaining tiles sort every pixel.
+    int first_tile_i = roi.y / Z_TILE_SIZE;
+    int first_tile_j = roi.x / Z_TILE_SIZE;
+    int tile_rows = (roi.y + roi.height - 1) / Z_TILE_SIZE - first_tile_i + 1;
+    int tile_cols = (roi.x + roi.width - 1) / Z_TILE_SIZE - first_tile_j + 1;
+
+    // The progress is reported once per band of tile_cols tiles, the remaining
+    // tiles are skipped after a cancellation.
+    std::atomic<int> tiles_done(0);
+    std::atomic<bool> cancelled(false);
+    int grid_cols = (z_images[0].width + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+
+    #pragma omp parallel
+    {
+        std::vector<LayerIndex> order;
+        PixelScratch scratch;
+
+        #pragma omp for collapse(2) schedule(dynamic)
+        for (int tile_i = first_tile_i; tile_i < first_tile_i + tile_rows; ++tile_i)
+        {
+            for (int tile_j = first_tile_j; tile_j < first_tile_j + tile_cols; ++tile_j)
+            {
+                if (cancelled)
+                    continue;
+
+                // The reused tiles are copied from the previous frame afterwards
+                if (reused_tiles.empty() || !reused_tiles[tile_i * grid_cols + tile_j])
+                {
+                    auto tile = roi & cv::Rect(tile_j * Z_TILE_SIZE, tile_i * Z_TILE_SIZE, Z_TILE_SIZE, Z_TILE_SIZE);
+                    bool ordered = tile_order(tile_i, tile_j, invert_z, order);
+                    bool sparse = all_sparse(order);
+
+                    for (int i = tile.y; i < tile.y + tile.height; ++i)
+                    {
+                        cv::Vec<AccT, 4> * result_row = result[i - roi.y];
+                        start_row(i, tile.x, order, scratch);
+                        for (int j = tile.x; j < tile.x + tile.width; ++j)
+                        {
+                            // With only sparse layers the pixels outside of their runs stay as they are
+                            if (sparse)
+                            {
+                                int next = std::min(tile.x + tile.width, next_visible(i, j, order, scratch));
+                                for (; j < next && aovs; ++j)
+                                    store_aov(aovs, i, j, i - roi.y, j - roi.x, PixelAOV(), invert_z);
+                                j = next;
+                                if (j == tile.x + tile.width)
+                                    break;
+                            }
+
+                            auto pixel = load_pixel(result_row[j - roi.x]);
+                            PixelAOV aov;
+                            if (ordered)
+                                blend_ordered<Fetch>(i, j, order, scratch, pixel, aovs ? &aov : nullptr);
+                            else
+                                merge_pixel<Fetch>(i, j, invert_z, order, scratch, pixel, aovs ? &aov : nullptr);
+                            store_pixel(pixel, result_row[j - roi.x]);
+                            if (aovs)
+                                store_aov(aovs, i, j, i - roi.y, j - roi.x, aov, invert_z);
+                        }
+                    }
+                }
+
+                int done = ++tiles_done;
+                if (progress && done % tile_cols == 0)
+                {
+                    #pragma omp critical(merge_progress)
+                    if (!progress(float(done) / (tile_rows * tile_cols)))
+                        cancelled = true;
+                }
+            }
+        }
+
+        ZImage::release_tile_cache();
+    }
+
+    if (cancelled)
+        throw MergeCancelled();
+}
+
+template <typename AccT, FetchFunction Fetch>
+void
+ZImageSet::merge_fan_out_tiles(std::vector<cv::Mat_<cv::Vec<AccT, 4>>> & results, cv::Rect roi, bool invert_z,
+                               MergeAOVs * aovs)
+{
+    // The tiles go as in merge_tiles, the visible layers of every pixel are
+    // gathered and ordered once and blended into the colour and all the colour AOVs.
+    int first_tile_i = roi.y / Z_TILE_SIZE;
+    int first_tile_j = roi.x / Z_TILE_SIZE;
+    int tile_rows = (roi.y + roi.height - 1) / Z_TILE_SIZE - first_tile_i + 1;
+    int tile_cols = (roi.x + roi.width - 1) / Z_TILE_SIZE - first_tile_j + 1;
+
+    #pragma omp parallel
+    {
+        std::vector<LayerIndex> order;
+        PixelScratch scratch;
+
+        #pragma omp for collapse(2) schedule(dynamic)
+        for (int tile_i = first_tile_i; tile_i < first_tile_i + tile_rows; ++tile_i)
+        {
+            for (int tile_j = first_tile_j; tile_j < first_tile_j + tile_cols; ++tile_j)
+            {
+                auto tile = roi & cv::Rect(tile_j * Z_TILE_SIZE, tile_i * Z_TILE_SIZE, Z_TILE_SIZE, Z_TILE_SIZE);
+                bool ordered = tile_order(tile_i, tile_j, invert_z, order);
+                bool sparse = all_sparse(order);
+
+                for (int i = tile.y; i < tile.y + tile.height; ++i)
+                {
+                    start_row(i, tile.x, order, scratch);
+                    for (int j = tile.x; j < tile.x + tile.width; ++j)
+                    {
+                        // With only sparse layers the pixels outside of their runs stay as they are
+                        if (sparse)
+                        {
+                            int next = std::min(tile.x + tile.width, next_visible(i, j, order, scratch));
+                            for (; j < next && aovs; ++j)
+                                store_aov(aovs, i, j, i - roi.y, j - roi.x, PixelAOV(), invert_z);
+                            j = next;
+                            if (j == tile.x + tile.width)
+                                break;
+                        }
+
+                        gather_pixel<Fetch>(i, j, invert_z, order, scratch, ordered);
+                        for (size_t k = 0; k < results.size(); ++k)
+                        {
+                            auto & result_pixel = results[k](i - roi.y, j - roi.x);
+                            auto pixel = load_pixel(result_pixel);
+                            for (auto & sample : scratch.samples)
+                            {
+                                auto & layer = z_images[sample.layer];
+                                blend_layer(pixel, k ? layer.get_aov(k - 1, i, j) : sample.rgba, layer.get_m(i, j));
+                            }
+                            store_pixel(pixel, result_pixel);
+                        }
+
+                        if (aovs)
+                        {
+                            PixelAOV aov;
+                            if (!scratch.samples.empty())
+                            {
+                                aov.front_layer = scratch.samples.back().layer;
+                                aov.coverage = scratch.samples.size();
+                            }
+                            store_aov(aovs, i, j, i - roi.y, j - roi.x, aov, invert_z);
+                        }
+                    }
+                }
+            }
+        }
+
+        ZImage::release_tile_cache();
+    }
+}
+
+template <typename AccT>
+void
+ZImageSet::merge_tiles_of_type(cv::Mat_<cv::Vec<AccT, 4>> & result, cv::Rect roi, bool invert_z, MergeAOVs * aovs,
+                               const std::vector<bool> & reused_tiles)
+{
+    switch (colour_type())
+    {
+        case CV_8UC3: merge_tiles<AccT, fetch_pixel<uint8_t, 3>>(result, roi, invert_z, aovs, reused_tiles); break;
+        case CV_8UC4: merge_tiles<AccT, fetch_pixel<uint8_t, 4>>(result, roi, invert_z, aovs, reused_tiles); break;
+        case CV_16UC3: merge_tiles<AccT, fetch_pixel<uint16_t, 3>>(result, roi, invert_z, aovs, reused_tiles); break;
+        case CV_16UC4: merge_tiles<AccT, fetch_pixel<uint16_t, 4>>(result, roi, invert_z, aovs, reused_tiles); break;
+        case CV_32FC3: merge_tiles<AccT, fetch_pixel<float, 3>>(result, roi, invert_z, aovs, reused_tiles); break;
+        case CV_32FC4: merge_tiles<AccT, fetch_pixel<float, 4>>(result, roi, invert_z, aovs, reused_tiles); break;
+        case CV_16FC4: merge_tiles<AccT, fetch_pixel<cv::float16_t, 4>>(result, roi, invert_z, aovs, reused_tiles); break;
+        default: merge_tiles<AccT, nullptr>(result, roi, invert_z, aovs, reused_tiles); break;
+    }
+}
+
+template <typename AccT>
+void
+ZImageSet::merge_fan_out_tiles_of_type(std::vector<cv::Mat_<cv::Vec<AccT, 4>>> & results, cv::Rect roi,
+                                       bool invert_z, MergeAOVs * aovs)
+{
+    switch (colour_type())
+    {
+        case CV_8UC3: merge_fan_out_tiles<AccT, fetch_pixel<uint8_t, 3>>(results, roi, invert_z, aovs); break;
+        case CV_8UC4: merge_fan_out_tiles<AccT, fetch_pixel<uint8_t, 4>>(results, roi, invert_z, aovs); break;
+        case CV_16UC3: merge_fan_out_tiles<AccT, fetch_pixel<uint16_t, 3>>(results, roi, invert_z, aovs); break;
+        case CV_16UC4: merge_fan_out_tiles<AccT, fetch_pixel<uint16_t, 4>>(results, roi, invert_z, aovs); break;
+        case CV_32FC3: merge_fan_out_tiles<AccT, fetch_pixel<float, 3>>(results, roi, invert_z, aovs); break;
+        case CV_32FC4: merge_fan_out_tiles<AccT, fetch_pixel<float, 4>>(results, roi, invert_z, aovs); break;
+        case CV_16FC4: merge_fan_out_tiles<AccT, fetch_pixel<cv::float16_t, 4>>(results, roi, invert_z, aovs); break;
+        default: merge_fan_out_tiles<AccT, nullptr>(results, roi, invert_z, aovs); break;
+    }
+}
+
+cv::Mat_<cv::Vec<uint16_t, 4>>
+ZImageSet::merge_images(bool invert_z, cv::Vec<float, 4> background, cv::Rect roi, MergeAOVs * aovs)
+{
+    roi = frame_roi(roi);
+    number_cache_layers();
+    init_aovs(aovs, roi);
+    if (premultiplied)
+        background = premultiply(background);
+    bool unpremultiply_result = premultiplied && !premultiplied_output;
+
+    std::vector<uint64_t> hashes;
+    std::vector<bool> reused_tiles;
+    if (tile_reuse)
+    {
+        hashes = frame_tile_hashes(invert_z, background);
+        reused_tiles = find_reused_tiles(hashes, roi, aovs);
+    }
+
+    cv::Mat_<cv::Vec<uint16_t, 4>> result_16;
+    if (output.rows == roi.height && output.cols == roi.width)
+        result_16 = output;
+
+    if (half_accumulator)
+    {
+        cv::Vec<cv::float16_t, 4> background_half;
+        store_half4(background, background_half.val);
+        cv::Mat_<cv::Vec<cv::float16_t, 4>> result(roi.height, roi.width, background_half);
+        merge_tiles_of_type(result, roi, invert_z, aovs, reused_tiles);
+        if (unpremultiply_result)
+            unpremultiply_image(result);
+        result.convertTo(result_16, CV_16U, MAX_16_BIT_VALUE);
+    }
+    else
+    {
+        cv::Mat_<cv::Vec<float, 4>> result(roi.height, roi.width, background);
+        merge_tiles_of_type(result, roi, invert_z, aovs, reused_tiles);
+        if (unpremultiply_result)
+            unpremultiply_image(result);
+        result.convertTo(result_16, CV_16U, MAX_16_BIT_VALUE);
+    }
+
+    if (tile_reuse)
+        reuse_tiles(result_16, roi, aovs, hashes, reused_tiles);
+
+    return result_16;
+}
+
+std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>>
+ZImageSet::merge_images_fan_out(bool invert_z, cv::Vec<float, 4> background, cv::Rect roi, MergeAOVs * aovs)
+{
+    roi = frame_roi(roi);
+    number_cache_layers();
+    init_aovs(aovs, roi);
+    if (premultiplied)
+        background = premultiply(background);
+    bool unpremultiply_result = premultiplied && !premultiplied_output;
+    size_t results_count = z_images[0].aov_mats.size() + 1;
+    for (auto & z_image : z_images)
+    {
+        if (z_image.aov_mats.size() + 1 != results_count)
+            throw std::runtime_error("All the layers must have the same colour AOVs!");
+    }
+
+    std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>> results_16(results_count);
+    if (output.rows == roi.height && output.cols == roi.width)
+        results_16[0] = output;
+
+    if (half_accumulator)
+    {
+        cv::Vec<cv::float16_t, 4> background_half;
+        store_half4(background, background_half.val);
+        std::vector<cv::Mat_<cv::Vec<cv::float16_t, 4>>> results(results_count);
+        for (auto & result : results)
+            result = cv::Mat_<cv::Vec<cv::float16_t, 4>>(roi.height, roi.width, background_half);
+        merge_fan_out_tiles_of_type(results, roi, invert_z, aovs);
+        for (size_t k = 0; k < results_count; ++k)
+        {
+            if (unpremultiply_result)
+                unpremultiply_image(results[k]);
+            results[k].convertTo(results_16[k], CV_16U, MAX_16_BIT_VALUE);
+        }
+    }
+    else
+    {
+        std::vector<cv::Mat_<cv::Vec<float, 4>>> results(results_count);
+        for (auto & result : results)
+            result = cv::Mat_<cv::Vec<float, 4>>(roi.height, roi.width, background);
+        merge_fan_out_tiles_of_type(results, roi, invert_z, aovs);
+        for (size_t k = 0; k < results_count; ++k)
+        {
+            if (unpremultiply_result)
+                unpremultiply_image(results[k]);
+            results[k].convertTo(results_16[k], CV_16U, MAX_16_BIT_VALUE);
+        }
+    }
+
+    return results_16;
+}
+
+cv::Mat_<cv::Vec<uint16_t, 4>>
+ZImageSet::merge_images_progressive(bool invert_z, cv::Vec<float, 4> background, cv::Rect roi,
+                                    ProgressCallback callback, int start_step, MergeAOVs * aovs)
+{
+    // Coarse-to-fine merge. The pass with step s merges every s-th pixel in both
+    // directions, skipping the pixels already merged by the previous (2*s) pass,
+    // so the passes together merge every pixel exactly once. After each pass the
+    // callback receives the merged grid upscaled to the full size (nearest sample).
+    roi = frame_roi(roi);
+    number_cache_layers();
+    init_aovs(aovs, roi);
+    if (premultiplied)
+        background = premultiply(background);
+    bool unpremultiply_result = premultiplied && !premultiplied_output;
+    cv::Mat_<cv::Vec<float, 4>> result(roi.height, roi.width, background);
+    cv::Mat_<cv::Vec<float, 4>> preview(roi.height, roi.width, background);
+
+    std::vector<LayerIndex> all_layers(z_images.size());
+    std::iota(all_layers.begin(), all_layers.end(), 0);
+
+    int step = 1;
+    while (step * 2 <= start_step)
+        step *= 2;
+
+    for (bool first_pass = true; step >= 1; step /= 2, first_pass = false)
+    {
+        #pragma omp parallel
+        {
+            PixelScratch scratch;
+
+            #pragma omp for
+            for (int i = 0; i < roi.height; i += step)
+            {
+                bool coarse_row = (i % (2 * step) == 0);
+
+                // On the rows of the previous grid every other pixel is already merged
+                int j_step = (coarse_row && !first_pass) ? 2 * step : step;
+                int j_start = (coarse_row && !first_pass) ? step : 0;
+                start_row(roi.y + i, roi.x + j_start, all_layers, scratch);
+                for (int j = j_start; j < roi.width; j += j_step)
+                {
+                    PixelAOV aov;
+                    merge_pixel<nullptr>(roi.y + i, roi.x + j, invert_z, all_layers, scratch, result(i, j),
+                                aovs ? &aov : nullptr);
+                    if (aovs)
+                        store_aov(aovs, roi.y + i, roi.x + j, i, j, aov, invert_z);
+                }
+            }
+
+            if (step == 1)
+                ZImage::release_tile_cache();
+        }
+
+        if (step == 1)
+            break;
+
+        #pragma omp parallel for
+        for (int i = 0; i < roi.height; ++i)
+        {
+            for (int j = 0; j < roi.width; ++j)
+            {
+                preview(i, j) = result(i - i % step, j - j % step);
+            }
+        }
+        if (unpremultiply_result)
+            unpremultiply_image(preview);
+        callback(cv::Mat_<cv::Vec<uint16_t, 4>>(preview*MAX_16_BIT_VALUE), step);
+    }
+
+    if (unpremultiply_result)
+        unpremultiply_image(result);
+    cv::Mat_<cv::Vec<uint16_t, 4>> final_result(result*MAX_16_BIT_VALUE);
+    callback(final_result, 1);
+
+    return final_result;
+}
+
+void
+ZImageSet::expand_z(bool inverted_z, int radius)
+{
+    for (auto & z_image : z_images)
+    {
+        if (z_image.is_compressed() || z_image.is_sparse())
+            throw std::runtime_error("The z-pass of compressed or sparse layers can't be expanded!");
+    }
+
+    // A radius expansion runs its rows in parallel, one layer after the other
+    if (radius > 0)
+    {
+        for (auto & z_image : z_images)
+            z_image.expand_z(inverted_z, radius);
+        return;
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < z_images.size(); ++i)
+    {
+        z_images[i].expand_z(inverted_z);
+    }
+}
+
+void
+ZImageSet::compress_layers()
+{
+    #pragma omp parallel for
+    for (int i = 0; i < z_images.size(); ++i)
+    {
+        z_images[i].compress();
+    }
+}
+
+void
+ZImageSet::sparse_layers(float max_coverage)
+{
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < z_images.size(); ++i)
+    {
+        z_images[i].make_sparse(max_coverage);
+    }
+}
+
+void
+ZImageSet::compute_tile_hashes()
+{
+    #pragma omp parallel for
+    for (int i = 0; i < z_images.size(); ++i)
+    {
+        z_images[i].compute_tile_hashes();
     }
 }
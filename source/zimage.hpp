@@ -5,43 +5,409 @@
 
 #include <opencv2/core.hpp>
 
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Index of a layer in a ZImageSet
+using LayerIndex = uint16_t;
+
+// Blends the straight alpha BGRA pixel 'b' over 'a', values in [0.0, 1.0]
+void
+blend_pixel(cv::Vec<float, 4> a, const cv::Vec<float, 4> & b,
+            BlendMode mode, cv::Vec<float, 4> & result);
+
+// Part of a frame of 'size' to load for merging 'roi' with a z-pass expansion
+// of 'radius' (see ZImage::expand_z): the roi and the pixels around it the
+// expansion reads. An empty roi (the whole frame) stays empty.
+cv::Rect
+expansion_roi(cv::Rect roi, cv::Size size, int radius);
+
+// Reads pixel (i, j) of a stored colour image as a normalized BGRA pixel
+using FetchFunction = cv::Vec<float, 4> (*)(const cv::Mat &, int, int);
+
 class ZImage
 {
     public:
 
-    cv::Mat_<cv::Vec<uint16_t, 4>> rgba_mat;
+    // BGR(A) pixels depending on the storage: as decoded (8-bit, 16-bit or float,
+    // 3 or 4 channels), CV_16UC4 or CV_16FC4 (values in [0.0, 1.0])
+    cv::Mat rgba_mat;
     cv::Mat_<cv::Vec<uint16_t, 1>> z_mat;
     BlendMode mode = BlendMode::NORMAL;
+    PixelStorage storage = PixelStorage::NATIVE;
+
+    // Min/max z of the visible (non-zero alpha) pixels of every Z_TILE_SIZE tile,
+    // min > max marks a tile without visible pixels.
+    cv::Mat_<uint16_t> z_tile_min;
+    cv::Mat_<uint16_t> z_tile_max;
+
+    // Colour AOVs sharing the z-pass and the visibility of the layer, in the
+    // storage format of their decoded images. Empty for the AOVs the layer lacks.
+    std::vector<cv::Mat> aov_mats;
+
+    // Hash of the pixels and the blend mode of every Z_TILE_SIZE tile (row-major),
+    // empty until compute_tile_hashes is called.
+    std::vector<uint64_t> tile_hashes;
 
     size_t width;
     size_t height;
 
+    // Resolution of the images the layer was loaded from, before the roi crop
+    cv::Size full_size;
+
     ZImage(){};
 
-    ZImage(std::string rgba_file_path, std::string z_file_path, BlendMode mode);
+    ZImage(std::string rgba_file_path, std::string z_file_path, BlendMode mode,
+           cv::Rect roi = cv::Rect(), PixelStorage storage = PixelStorage::NATIVE);
+
+    // From already decoded images
+    ZImage(cv::Mat rgba_mat_, cv::Mat z_mat_, BlendMode mode,
+           cv::Rect roi = cv::Rect(), PixelStorage storage = PixelStorage::NATIVE);
+
+    // Adds the next colour AOV, an empty 'aov_mat' for an AOV the layer lacks.
+    // The roi is the one the layer was loaded with, the AOV image must have the
+    // full resolution of the layer images.
+    void
+    add_aov(cv::Mat aov_mat, cv::Rect roi = cv::Rect());
 
-    uint16_t& get_r(int, int);
-    uint16_t& get_g(int, int);
-    uint16_t& get_b(int, int);
-    uint16_t& get_a(int, int);
-    uint16_t& get_z(int, int);
+    // Normalized [0.0, 1.0] BGRA pixel
+    cv::Vec<float, 4> get_rgba(int, int);
+    cv::Vec<float, 4> get_aov(size_t, int, int);
+    // By value, compressed and sparse layers have no z-pass to write into
+    uint16_t get_z(int, int);
     BlendMode get_m(int, int);
+
+    // Row walks of a sparse layer, left to right: 'run' is set by first_run and moved
+    // forward by the reads, so a row costs a single search of its runs. The other
+    // storages ignore it. get_z with a run is only valid for a visible pixel.
+    // A 'Fetch' for the stored format replaces the indirect call of the layer's
+    // fetch by a direct one (see ZImageSet::colour_type).
+    int first_run(int i, int j);
+    template <FetchFunction Fetch = nullptr>
+    cv::Vec<float, 4> get_rgba(int i, int j, int & run);
+    uint16_t get_z(int i, int j, int run);
+
+    // First column from j on with a visible pixel of a sparse layer, 'width' if none
+    int next_visible(int i, int j, int & run);
+
+    // OpenCV type of the stored colour pixels
+    int rgba_type();
+
+    // Grows the z-pass: erodes it if 'inverted_z', dilates it otherwise. By a pixel
+    // with the default radius of 0, by a (2 * radius + 1) square otherwise.
+    void
+    expand_z(bool inverted_z, int radius = 0);
+
+    void
+    compute_z_bounds();
+
+    // Hashes the stored pixels, before the layer is compressed
+    void
+    compute_tile_hashes();
+
+    // Replaces rgba_mat and z_mat by losslessly compressed Z_TILE_SIZE tiles,
+    // the pixel accessors decompress them on demand into a per-thread cache.
+    // The colour AOVs stay uncompressed, sparse layers stay as they are.
+    void
+    compress();
+
+    // Compresses the layer and moves the tiles to an unlinked file of 'scratch_dir',
+    // mapped in memory so the system can page them out. Sparse layers stay in memory.
+    void
+    spill(std::string scratch_dir);
+
+    // Fraction of the pixels with a non-zero alpha
+    float
+    coverage();
+
+    // Replaces rgba_mat and z_mat by the runs of visible pixels of every row if
+    // they cover at most 'max_coverage' of the layer. The pixels of the runs are
+    // packed in the storage format, the accessors find them by a binary search
+    // of the runs of the row and give a transparent pixel outside of them (with
+    // no meaningful z). The colour AOVs stay as they are.
+    void
+    make_sparse(float max_coverage = 1.0f);
+
+    // Number of the layer in its set and tile cache slots of the set, a power of 2
+    // at least twice the layers (see ZImageSet::number_cache_layers)
+    void
+    set_cache_layer(int layer, size_t slots);
+
+    // Frees the tile cache of the calling thread, the merges of a set call it on
+    // their threads once done
+    static void
+    release_tile_cache();
+
+    bool
+    is_compressed();
+
+    bool
+    is_sparse();
+
+    // Bytes used by the pixel data, not counting the spilled tiles
+    size_t
+    memory_size();
+
+    private:
+
+    struct CompressedTiles;
+    struct CachedTile;
+    struct SparseRuns;
+
+    CachedTile &
+    cached_tile(int i, int j);
+
+    // Tile cache of the calling thread
+    static std::vector<CachedTile> &
+    tile_cache();
+
+    // Index of pixel (i, j) in the packed pixels of the runs, -1 if it's transparent
+    int
+    sparse_index(int i, int j);
+
+    FetchFunction fetch_rgba = nullptr;
+    std::vector<FetchFunction> fetch_aovs;
+
+    // Shared by the copies of the layer, the data is never modified
+    std::shared_ptr<const CompressedTiles> tiles;
+    std::shared_ptr<SparseRuns> runs;
+
+    size_t visible_pixels = 0;
+
+    int cache_layer = 0;
+    size_t cache_slots = TILE_CACHE_SLOTS;
+};
+
+// Per pixel by-products of a merge (AOVs), filled in the same pass as the colour
+struct MergeAOVs
+{
+    // z of the front-most visible layer, the far plane where no layer is visible
+    cv::Mat_<uint16_t> depth;
+    // Index of the front-most visible layer, NO_LAYER where no layer is visible
+    cv::Mat_<uint16_t> front_layer;
+    // Number of visible layers blended into the pixel
+    cv::Mat_<uint16_t> coverage;
+};
+
+// Merged tiles of the previous frame of a sequence. merge_images copies the
+// tiles whose layers all hash the same as in the previous frame instead of
+// merging them again, and keeps the new result for the next frame.
+struct TileReuse
+{
+    std::vector<uint64_t> tile_hashes;
+    cv::Mat_<cv::Vec<uint16_t, 4>> result;
+    MergeAOVs aovs;
+    cv::Rect roi;
+
+    // Totals of all the frames
+    size_t tiles_reused = 0;
+    size_t tiles_merged = 0;
+};
+
+// Thrown by merge_images when the progress callback cancels the merge
+class MergeCancelled : public std::runtime_error
+{
+    public:
+
+    MergeCancelled() : std::runtime_error("The merge was cancelled!") {}
 };
 
 class ZImageSet
 {
     public:
 
+    // Receives a merged image and the grid step it was merged with (1 is the final one).
+    using ProgressCallback = std::function<void(const cv::Mat_<cv::Vec<uint16_t, 4>> &, int)>;
+
+    // Receives the merged fraction after every band of tile rows, returning false
+    // cancels the merge. Called by one thread at a time.
+    using MergeProgress = std::function<bool(float)>;
+
     std::vector<ZImage> z_images;
+
+    // Keep the merge accumulator in half instead of float precision
+    bool half_accumulator = false;
+
+    // Blend premultiplied colours, the layer pixels are premultiplied as they are
+    // read and the result is unpremultiplied once, unless premultiplied_output is
+    // set. The output stays within one 16-bit code of the straight alpha blending,
+    // the rounding error of a colour grows as 1/alpha for nearly transparent pixels.
+    bool premultiplied = false;
+    bool premultiplied_output = false;
+
+    // Progress and cancellation of merge_images (optional)
+    MergeProgress progress;
+
+    // Temporal tile reuse of merge_images (optional), needs the tile hashes of all the layers
+    TileReuse * tile_reuse = nullptr;
+
+    // Buffer merge_images stores the result into when it has the size of the
+    // result (optional), e.g. the pixels of a mapped output image
+    cv::Mat_<cv::Vec<uint16_t, 4>> output;
     
-    ZImageSet(unsigned short images_count);
+    ZImageSet(size_t images_count);
+
+    // Loads the layers to merge 'roi' (the whole frame if empty) in parallel,
+    // load(k, load_roi) sets z_images[k]. With expand_z the layers also get the
+    // pixels around the roi the z-pass expansion reads, 'frame_size' gives the
+    // frame size for it. Returns the roi to merge in the loaded layers.
+    // An exception can't leave the parallel loop: the layers after a failure are
+    // skipped and the error messages are added to 'errors'.
+    cv::Rect
+    load_layers(cv::Rect roi, bool expand_z, int expand_radius,
+                const std::function<cv::Size()> & frame_size,
+                const std::function<void(int, cv::Rect)> & load,
+                std::vector<std::string> & errors);
     
     bool
     resolution_check();
     
     cv::Mat_<cv::Vec<uint16_t, 4>>
-    merge_images(bool invert_z, cv::Vec<float, 4> background);
+    merge_images(bool invert_z, cv::Vec<float, 4> background = {0, 0, 0, 0},
+                 cv::Rect roi = cv::Rect(), MergeAOVs * aovs = nullptr);
+
+    // Merges the colours and the colour AOVs of the layers with a single depth
+    // ordering per pixel, result 0 is the colour and result k + 1 is AOV k.
+    // The layers must have the same number of colour AOVs.
+    std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>>
+    merge_images_fan_out(bool invert_z, cv::Vec<float, 4> background = {0, 0, 0, 0},
+                         cv::Rect roi = cv::Rect(), MergeAOVs * aovs = nullptr);
+
+    cv::Mat_<cv::Vec<uint16_t, 4>>
+    merge_images_progressive(bool invert_z, cv::Vec<float, 4> background, cv::Rect roi,
+                             ProgressCallback callback, int start_step = 8,
+                             MergeAOVs * aovs = nullptr);
+
+    void
+    expand_z(bool inverted_z, int radius = 0);
+
+    void
+    compress_layers();
+
+    // Makes the layers covering at most 'max_coverage' of the frame sparse
+    void
+    sparse_layers(float max_coverage = SPARSE_COVERAGE_LIMIT);
+
+    void
+    compute_tile_hashes();
+
+    private:
+
+    // AOV values of the pixel being blended
+    struct PixelAOV
+    {
+        int front_layer = -1;
+        int coverage = 0;
+    };
+
+    // Visible layer pixel gathered for the per-pixel depth sort
+    struct LayerSample
+    {
+        uint16_t key;
+        LayerIndex layer;
+        cv::Vec<float, 4> rgba;
+    };
+
+    // Per-thread buffers of merge_pixel, they grow to the most covered pixel,
+    // and the row walks of the layers being merged (see ZImage::first_run)
+    struct PixelScratch
+    {
+        std::vector<LayerSample> samples;
+        std::vector<LayerSample> buffer;
+        std::vector<int> runs;
+    };
+
+    cv::Rect
+    frame_roi(cv::Rect roi);
+
+    // Numbers the layers for the tile cache of the compressed layers
+    void
+    number_cache_layers();
+
+    void
+    init_aovs(MergeAOVs * aovs, cv::Rect roi);
+
+    void
+    store_aov(MergeAOVs * aovs, int i, int j, int result_i, int result_j,
+              const PixelAOV & aov, bool invert_z);
+
+    bool
+    tile_order(int tile_i, int tile_j, bool invert_z, std::vector<LayerIndex> & order);
+
+    void
+    blend_layer(cv::Vec<float, 4> & pixel, const cv::Vec<float, 4> & rgba, BlendMode mode);
+
+    // Starts the row walks of 'layers' on row i at column j, the pixels of the row
+    // are then read left to right
+    void
+    start_row(int i, int j, const std::vector<LayerIndex> & layers, PixelScratch & scratch);
+
+    // First column from j on where one of 'layers' is visible, if they are all sparse
+    int
+    next_visible(int i, int j, const std::vector<LayerIndex> & layers, PixelScratch & scratch);
+
+    bool
+    all_sparse(const std::vector<LayerIndex> & layers);
+
+    // Colour type shared by all the layers, -1 if they differ. The merges of a
+    // shared type are compiled with its fetch as the 'Fetch' template argument of
+    // the pixel functions, the others call the fetch of every layer (nullptr).
+    int
+    colour_type();
+
+    // Gathers the visible pixels of 'layers' into scratch.samples sorted by depth,
+    // 'layers' are in layer order, or already in blending order if 'ordered'
+    template <FetchFunction Fetch>
+    void
+    gather_pixel(int i, int j, bool invert_z, const std::vector<LayerIndex> & layers,
+                 PixelScratch & scratch, bool ordered);
+
+    // Blends the visible pixels of 'layers' (in layer order) sorted by depth
+    template <FetchFunction Fetch>
+    void
+    merge_pixel(int i, int j, bool invert_z,
+                const std::vector<LayerIndex> & layers,
+                PixelScratch & scratch,
+                cv::Vec<float, 4> & pixel,
+                PixelAOV * aov = nullptr);
+
+    template <FetchFunction Fetch>
+    void
+    blend_ordered(int i, int j, const std::vector<LayerIndex> & order, PixelScratch & scratch,
+                  cv::Vec<float, 4> & pixel, PixelAOV * aov = nullptr);
+
+    // Combined hash of the layers of every tile, empty if a layer has no tile hashes
+    std::vector<uint64_t>
+    frame_tile_hashes(bool invert_z, const cv::Vec<float, 4> & background);
+
+    std::vector<bool>
+    find_reused_tiles(const std::vector<uint64_t> & hashes, cv::Rect roi, MergeAOVs * aovs);
+
+    void
+    reuse_tiles(cv::Mat_<cv::Vec<uint16_t, 4>> & result, cv::Rect roi, MergeAOVs * aovs,
+                const std::vector<uint64_t> & hashes, const std::vector<bool> & reused_tiles);
+
+    template <typename AccT, FetchFunction Fetch>
+    void
+    merge_tiles(cv::Mat_<cv::Vec<AccT, 4>> & result, cv::Rect roi, bool invert_z, MergeAOVs * aovs,
+                const std::vector<bool> & reused_tiles);
+
+    template <typename AccT, FetchFunction Fetch>
+    void
+    merge_fan_out_tiles(std::vector<cv::Mat_<cv::Vec<AccT, 4>>> & results, cv::Rect roi, bool invert_z,
+                        MergeAOVs * aovs);
+
+    // merge_tiles and merge_fan_out_tiles for the colour type of the layers
+    template <typename AccT>
+    void
+    merge_tiles_of_type(cv::Mat_<cv::Vec<AccT, 4>> & result, cv::Rect roi, bool invert_z, MergeAOVs * aovs,
+                        const std::vector<bool> & reused_tiles);
 
+    template <typename AccT>
     void
-    expand_z(bool inverted_z);
+    merge_fan_out_tiles_of_type(std::vector<cv::Mat_<cv::Vec<AccT, 4>>> & results, cv::Rect roi,
+                                bool invert_z, MergeAOVs * aovs);
 };
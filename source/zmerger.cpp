@@ -2,8 +2,19 @@
 // Date   :: Juli 2018
 // Author :: Alexander Kasperovich
 
+#include "async_io.hpp"
+#include "buffer_pool.hpp"
+#include "dependency.hpp"
 #include "json11.hpp"
+#include "manifest.hpp"
+#include "memory_budget.hpp"
+#include "perf_counters.hpp"
+#include "preflight.hpp"
+#include "pyramid.hpp"
+#include "raw_output.hpp"
+#include "shard.hpp"
 #include "utilities.hpp"
+#include "validation.hpp"
 #include "zimage.hpp"
 
 #include <opencv2/core/core.hpp>
@@ -17,100 +28,894 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <math.h>
 #include <numeric>
+#include <stdexcept>
+#include <string>
 #include <omp.h>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
-int main(int argc, char** argv)
+// Settings shared by all the frames of a run
+struct MergeSettings
 {
+    bool invert_z = false;
+    bool expand_z = false;
+    int expand_radius = 0;
+    int out_res_x = 0;
+    int out_res_y = 0;
+    cv::Rect roi;
+    int progressive_step = 0;
+    int pyramid_levels = 0;
+    std::vector<cv::Size> output_sizes;
+    PixelStorage storage = PixelStorage::NATIVE;
+    bool premultiplied = false;
+    bool premultiplied_output = false;
+    AsyncIO * async_io = nullptr;
+    BufferPool * buffer_pool = nullptr;
+    bool compress_layers = false;
+    bool aovs = false;
+    int shards = 0;
+    ShardTransport * shard_transport = nullptr;
+    PerfCounters * perf_counters = nullptr;
+    MemoryBudget * memory_budget = nullptr;
+    std::string scratch_dir;
+    TileReuse * tile_reuse = nullptr;
+    RawOutputMode raw_output = RawOutputMode::NONE;
+    bool preflight = true;
+};
 
-    if (argc < 5)
+void
+perf_begin(const MergeSettings & settings, std::string stage)
+{
+    if (settings.perf_counters)
+        settings.perf_counters->begin(stage);
+}
+
+void
+perf_end(const MergeSettings & settings, double megapixels)
+{
+    if (settings.perf_counters)
+        settings.perf_counters->end(megapixels);
+}
+
+// Rescale output image if neccessary
+cv::Mat_<cv::Vec<uint16_t, 4>>
+rescale(cv::Mat_<cv::Vec<uint16_t, 4>> image, const MergeSettings & settings)
+{
+    if (settings.out_res_x > 0 && settings.out_res_y > 0)
     {
-        std::cout << "Input parameters error! Use json name path, png output file path, zpass inversion mode and zpass extension flag as parameters.";
-        return 1;
+        cv::Size size(settings.out_res_x, settings.out_res_y);
+        cv::resize(image, image, size, 0, 0, cv::INTER_CUBIC);
     }
+    return image;
+}
+
+cv::Mat_<cv::Vec<uint16_t, 4>>
+merge_local(const FrameEntry & frame, const FramePlan & plan, const MergeSettings & settings,
+            MergeAOVs * aovs, cv::Mat_<cv::Vec<uint16_t, 4>> output,
+            std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>> & colour_aovs)
+{
+    auto output_image_path = frame.output_file_path;
+    int images_count = frame.layers.size();
+    auto aov_names = colour_aov_names(frame);
 
-    auto json_file_path = std::string(argv[1]);
-    auto output_image_path = std::string(argv[2]);
-    bool invert_z = std::stoi(std::string(argv[3]));
-    bool expand_z = std::stoi(std::string(argv[4]));
+    // Starting time tracking for images reading process
+    auto t1 = get_time();
+    perf_begin(settings, "load");
 
-    // Get the output resolution (optional)
-    int out_res_x = 0;
-    int out_res_y = 0;
-    if (argc == 7)
+    auto zimage_set = ZImageSet(images_count);
+    zimage_set.half_accumulator = (settings.storage == PixelStorage::HALF);
+    zimage_set.premultiplied = settings.premultiplied;
+    zimage_set.premultiplied_output = settings.premultiplied_output;
+    zimage_set.tile_reuse = settings.tile_reuse;
+    zimage_set.output = output;
+
+    // With asynchronous file I/O all the layer and colour AOV files are requested
+    // up front and decoded from memory as soon as they arrive. The AOV file of
+    // layer k and name n is aov_files[k * aov_names.size() + n].
+    std::vector<std::future<std::vector<uint8_t>>> layer_files;
+    std::vector<std::future<std::vector<uint8_t>>> aov_files;
+    if (settings.async_io)
     {
-        out_res_x = std::stoi(std::string(argv[5]));
-        out_res_y = std::stoi(std::string(argv[6]));
+        for (auto & layer : frame.layers)
+        {
+            layer_files.push_back(settings.async_io->read_file(layer.rgba_file_path));
+            layer_files.push_back(settings.async_io->read_file(layer.z_file_path));
+            for (auto & name : aov_names)
+            {
+                auto aov = layer.colour_aov_file_paths.find(name);
+                aov_files.push_back((aov != layer.colour_aov_file_paths.end()) ?
+                                    settings.async_io->read_file(aov->second) :
+                                    std::future<std::vector<uint8_t>>());
+            }
+        }
     }
 
-    auto json_string = read_json_string(json_file_path);
-    std::string error_message;
-    json11::Json IMAGES_DATA_INFO = json11::Json::parse(json_string, error_message);
-    unsigned short images_count = IMAGES_DATA_INFO.array_items().size();
-    if (images_count == 0)
+    // With a memory budget the decodes wait until their planned peak fits,
+    // and if even the loaded layers don't fit they are spilled to the scratch
+    // directory (expanded first, spilled layers can't be expanded).
+    auto & costs = plan.costs;
+    size_t reserved = 0;
+    bool spill = false;
+    if (settings.memory_budget)
     {
-        std::cout << json_string << std::endl;
-        std::cout << "Warning! No input images found, aborting..." << std::endl;
-        return 1;
+        reserved = plan.result;
+        spill = (plan.steady > settings.memory_budget->budget());
+        if (spill)
+            std::cout << "Layers need " << plan.steady / 1048576.0 << " MB, spilling them to " << settings.scratch_dir << std::endl;
+
+        // The merge result is kept apart for the whole frame
+        settings.memory_budget->hold(reserved);
     }
 
-    // Starting global time tracking
-    auto start_time = get_time();
+    // Reading the source images, the layers failing to load are reported after it
+    std::vector<std::string> errors;
+    std::vector<char> held(images_count, 0);
+    auto load_layer = [&](int k, cv::Rect load_roi)
+    {
+        auto & layer = frame.layers[k];
+        if (settings.memory_budget)
+            settings.memory_budget->acquire(costs[k].decode + costs[k].steady);
 
-    // Starting time tracking for images reading process
-    auto t1 = get_time();
+        try
+        {
+            if (settings.async_io)
+                zimage_set.z_images[k] = ZImage(
+                        cv::imdecode(layer_files[2 * k].get(), cv::IMREAD_UNCHANGED),
+                        cv::imdecode(layer_files[2 * k + 1].get(), cv::IMREAD_UNCHANGED),
+                        layer.mode, load_roi, settings.storage
+                );
+            else
+                zimage_set.z_images[k] = ZImage(
+                        layer.rgba_file_path, layer.z_file_path,
+                        layer.mode, load_roi, settings.storage
+                );
 
-    auto zimage_set = ZImageSet(images_count);
-    
-    // Reading the source images
-    #pragma omp parallel for
-    for (int k=0; k<images_count; ++k)
-    {   
-        zimage_set.z_images[k] = ZImage(
-                IMAGES_DATA_INFO[k]["I"].string_value(),
-                IMAGES_DATA_INFO[k]["Z"].string_value(),
-                static_cast<BlendMode>(std::stoi(IMAGES_DATA_INFO[k]["M"].string_value()))
-        );
+            // Colour AOVs sharing the z-pass, the ones the layer lacks stay transparent
+            for (size_t n = 0; n < aov_names.size(); ++n)
+            {
+                auto aov = layer.colour_aov_file_paths.find(aov_names[n]);
+                cv::Mat aov_mat;
+                if (aov != layer.colour_aov_file_paths.end())
+                {
+                    if (settings.async_io)
+                        aov_mat = cv::imdecode(aov_files[k * aov_names.size() + n].get(), cv::IMREAD_UNCHANGED);
+                    else
+                        aov_mat = cv::imread(aov->second, cv::IMREAD_UNCHANGED);
+                    if (aov_mat.empty())
+                        throw std::runtime_error("Can't read the colour AOV " + aov->second);
+                }
+                zimage_set.z_images[k].add_aov(aov_mat, load_roi);
+            }
+
+            if (spill)
+            {
+                if (settings.expand_z)
+                    zimage_set.z_images[k].expand_z(settings.invert_z, settings.expand_radius);
+                if (settings.tile_reuse)
+                    zimage_set.z_images[k].compute_tile_hashes();
+                zimage_set.z_images[k].spill(settings.scratch_dir);
+            }
+        }
+        catch (const std::exception & e)
+        {
+            if (settings.memory_budget)
+                settings.memory_budget->release(costs[k].decode + costs[k].steady);
+            throw std::runtime_error(layer.rgba_file_path + ": " + e.what());
+        }
+
+        if (settings.memory_budget)
+        {
+            settings.memory_budget->release(costs[k].decode + costs[k].steady);
+            if (!spill)
+            {
+                settings.memory_budget->hold(costs[k].steady);
+                held[k] = 1;
+            }
+        }
+    };
+    auto frame_size = [&]() { return plan.size.empty() ? image_size(frame.layers[0].rgba_file_path) : plan.size; };
+    auto merge_roi = zimage_set.load_layers(settings.roi, settings.expand_z, settings.expand_radius,
+                                            frame_size, load_layer, errors);
+
+    if (settings.memory_budget)
+    {
+        for (int k = 0; k < images_count; ++k)
+        {
+            if (held[k])
+                reserved += costs[k].steady;
+        }
+        std::cout << "Memory budget peak: " << settings.memory_budget->peak() / 1048576.0 << " MB" << std::endl;
+    }
+
+    if (!errors.empty())
+    {
+        for (auto & error : errors)
+            std::cout << "Loading error! " << error << std::endl;
+        if (settings.memory_budget)
+            settings.memory_budget->drop(reserved);
+        return cv::Mat_<cv::Vec<uint16_t, 4>>();
     }
 
     if (!zimage_set.resolution_check())
     {
         std::cout << "Resolution error! Input images have different resolutions." << std::endl;
-        return 1;
+        if (settings.memory_budget)
+            settings.memory_budget->drop(reserved);
+        return cv::Mat_<cv::Vec<uint16_t, 4>>();
     }
+    double megapixels = zimage_set.z_images[0].width * zimage_set.z_images[0].height / 1e6;
+    perf_end(settings, megapixels);
 
     // Expand the z-pass if needed.
-    if (expand_z)
-        zimage_set.expand_z(invert_z);
+    if (settings.expand_z && !spill)
+    {
+        perf_begin(settings, "expand_z");
+        zimage_set.expand_z(settings.invert_z, settings.expand_radius);
+        perf_end(settings, megapixels);
+    }
+
+    // Hash the layer tiles for the temporal tile reuse if needed.
+    if (settings.tile_reuse && !spill)
+        zimage_set.compute_tile_hashes();
+
+    // Store the mostly empty layers as runs of visible pixels.
+    if (!spill)
+    {
+        perf_begin(settings, "sparse");
+        zimage_set.sparse_layers();
+        perf_end(settings, megapixels);
+        auto sparse_count = std::count_if(zimage_set.z_images.begin(), zimage_set.z_images.end(),
+                                          [](ZImage & z_image) { return z_image.is_sparse(); });
+        if (sparse_count > 0)
+            std::cout << "Sparse layers: " << sparse_count << " of " << images_count << std::endl;
+    }
+
+    // Keep the layers compressed in memory if needed.
+    if (settings.compress_layers)
+    {
+        size_t raw_size = 0;
+        size_t compressed_size = 0;
+        for (auto & z_image : zimage_set.z_images)
+            raw_size += z_image.memory_size();
+        zimage_set.compress_layers();
+        for (auto & z_image : zimage_set.z_images)
+            compressed_size += z_image.memory_size();
+        std::cout << "Layers compressed: " << raw_size / 1048576.0 << " MB -> " << compressed_size / 1048576.0 << " MB" << std::endl;
+    }
 
     // Print timing
     auto duration = (get_time() - t1).count() / 1000.0;
     std::cout << "Images are loaded! Elapsed time: " << duration << std::endl;
     t1 = get_time();
+    perf_begin(settings, "merge");
 
-    auto result = zimage_set.merge_images(invert_z, {0, 0, 0, 0});
+    cv::Mat_<cv::Vec<uint16_t, 4>> result;
+    if (settings.progressive_step > 0)
+    {
+        // Coarse previews are written next to the output as <name>_step<N>.<ext>
+        auto on_pass = [&](const cv::Mat_<cv::Vec<uint16_t, 4>> & preview, int step)
+        {
+            if (step == 1)
+                return;
+            auto preview_path = suffixed_path(output_image_path, "_step" + std::to_string(step));
+            cv::imwrite(preview_path, rescale(preview, settings));
+            std::cout << "Preview saved: " << preview_path << " Elapsed time: " << (get_time() - t1).count() / 1000.0 << std::endl;
+        };
+        result = zimage_set.merge_images_progressive(settings.invert_z, {0, 0, 0, 0}, merge_roi,
+                                                     on_pass, settings.progressive_step, aovs);
+    }
+    else if (!aov_names.empty())
+    {
+        // One depth ordering for the colour and all the colour AOVs
+        auto results = zimage_set.merge_images_fan_out(settings.invert_z, {0, 0, 0, 0}, merge_roi, aovs);
+        result = results[0];
+        colour_aovs.assign(results.begin() + 1, results.end());
+    }
+    else
+    {
+        size_t reused = settings.tile_reuse ? settings.tile_reuse->tiles_reused : 0;
+        size_t merged = settings.tile_reuse ? settings.tile_reuse->tiles_merged : 0;
+        result = zimage_set.merge_images(settings.invert_z, {0, 0, 0, 0}, merge_roi, aovs);
+        if (settings.tile_reuse)
+        {
+            reused = settings.tile_reuse->tiles_reused - reused;
+            merged = settings.tile_reuse->tiles_merged - merged;
+            std::cout << "Tiles reused from the previous frame: " << reused << " of " << reused + merged << std::endl;
+        }
+    }
+    perf_end(settings, megapixels);
 
     duration = (get_time() - t1).count() / 1000.0;
     std::cout << "Pixel blending done! Elapsed time: " << duration << std::endl;
-    t1 = get_time();
 
-    // Rescale output image if neccessary
-    if (bool(out_res_x * out_res_y))
+    if (settings.memory_budget)
+        settings.memory_budget->drop(reserved);
+
+    return result;
+}
+
+cv::Mat_<cv::Vec<uint16_t, 4>>
+merge_sharded(const FrameEntry & frame, const MergeSettings & settings,
+              cv::Mat_<cv::Vec<uint16_t, 4>> output)
+{
+    auto t1 = get_time();
+
+    // The frame size comes from the first z-pass, the workers check the layers
+    auto size = image_size(frame.layers[0].z_file_path);
+    cv::Rect frame_rect(0, 0, size.width, size.height);
+    auto roi = settings.roi.empty() ? frame_rect : settings.roi;
+    if ((roi & frame_rect) != roi)
+        throw std::runtime_error("Region of interest is out of the image bounds!");
+
+    // The z-pass expansion of a band needs the pixels around it, within the frame
+    auto bands = shard_bands(roi, settings.shards);
+    for (size_t k = 0; k < bands.size(); ++k)
+    {
+        ShardRequest request;
+        request.layers = frame.layers;
+        request.band = bands[k];
+        request.load_roi = settings.expand_z ? expansion_roi(bands[k], size, settings.expand_radius) : bands[k];
+        request.invert_z = settings.invert_z;
+        request.expand_z = settings.expand_z;
+        request.expand_radius = settings.expand_radius;
+        request.half = (settings.storage == PixelStorage::HALF);
+        request.premultiplied = settings.premultiplied;
+        request.premultiplied_output = settings.premultiplied_output;
+        request.compress_layers = settings.compress_layers;
+        settings.shard_transport->start(k, request);
+    }
+
+    cv::Mat_<cv::Vec<uint16_t, 4>> result = output;
+    if (result.rows != roi.height || result.cols != roi.width)
+        result.create(roi.height, roi.width);
+    for (size_t k = 0; k < bands.size(); ++k)
+        settings.shard_transport->finish(k, result(bands[k] - roi.tl()));
+
+    auto duration = (get_time() - t1).count() / 1000.0;
+    std::cout << "Sharded merge of " << bands.size() << " bands done! Elapsed time: " << duration << std::endl;
+
+    return result;
+}
+
+bool
+merge_frame(const FrameEntry & frame, const MergeSettings & settings, std::vector<std::string> & output_paths)
+{
+    auto output_image_path = frame.output_file_path;
+    auto aov_names = colour_aov_names(frame);
+    if (!aov_names.empty() && (settings.shard_transport || settings.progressive_step > 0))
     {
-        cv::Size size(out_res_x, out_res_y);
-        cv::resize(result, result, size, 0, 0, cv::INTER_CUBIC);
+        std::cout << "Colour AOVs of " << output_image_path << " can't be merged with --shards or --progressive." << std::endl;
+        return false;
     }
 
-    // Save the result
-    cv::imwrite(output_image_path, result);
+    // Checked again from the headers with the pre-flight, the files may have changed since
+    auto plan = settings.preflight ? plan_frame(frame, settings.roi, settings.storage)
+                                   : estimate_frame(frame, settings.roi, settings.storage);
+    if (!plan.errors.empty())
+    {
+        for (auto & error : plan.errors)
+            std::cout << error << std::endl;
+        return false;
+    }
+
+    // A raw output of a known size is merged straight into its mapping, the
+    // progressive merge has its own result buffers and the output is written after it
+    std::unique_ptr<RawImage> raw_result;
+    cv::Mat_<cv::Vec<uint16_t, 4>> output;
+    if (settings.raw_output != RawOutputMode::NONE && !(settings.out_res_x > 0 && settings.out_res_y > 0)
+        && settings.progressive_step == 0)
+    {
+        auto size = settings.roi.empty() ? plan.size : settings.roi.size();
+        if (!size.empty())
+        {
+            raw_result.reset(new RawImage(output_image_path, settings.raw_output, size, CV_16UC4));
+            output = raw_result->image;
+        }
+    }
+
+    MergeAOVs aovs;
+    std::vector<cv::Mat_<cv::Vec<uint16_t, 4>>> colour_aovs;
+    cv::Mat_<cv::Vec<uint16_t, 4>> result;
+    if (settings.shard_transport)
+    {
+        // The workers report their own loading errors, a failed shard fails the frame
+        try
+        {
+            result = merge_sharded(frame, settings, output);
+        }
+        catch (const std::exception & error)
+        {
+            std::cout << error.what() << std::endl;
+            return false;
+        }
+    }
+    else
+        result = merge_local(frame, plan, settings, settings.aovs ? &aovs : nullptr, output, colour_aovs);
+    if (result.empty())
+        return false;
+
+    auto t1 = get_time();
+    double megapixels = result.total() / 1e6;
+    perf_begin(settings, "resize");
+    result = rescale(result, settings);
+
+    // Derive the extra resolutions, each one is saved as <name>_<w>x<h>.<ext>
+    auto output_sizes = settings.output_sizes;
+    auto pyramid = pyramid_sizes(result.size(), settings.pyramid_levels);
+    output_sizes.insert(output_sizes.end(), pyramid.begin(), pyramid.end());
+    auto levels = build_pyramid(result, output_sizes);
+
+    output_paths = {output_image_path};
+    std::vector<cv::Mat> output_images = {result};
+    for (size_t k = 0; k < levels.size(); ++k)
+    {
+        auto suffix = "_" + std::to_string(levels[k].cols) + "x" + std::to_string(levels[k].rows);
+        output_paths.push_back(suffixed_path(output_image_path, suffix));
+        output_images.push_back(levels[k]);
+    }
+
+    // The colour AOVs are saved as <name>_<aov name>.<ext>
+    for (size_t k = 0; k < colour_aovs.size(); ++k)
+    {
+        output_paths.push_back(suffixed_path(output_image_path, "_" + aov_names[k]));
+        output_images.push_back(rescale(colour_aovs[k], settings));
+    }
+
+    // The AOVs are saved as 16-bit single channel <name>_depth/_layer/_coverage.<ext>,
+    // they are rescaled without interpolation
+    if (settings.aovs)
+    {
+        std::vector<std::pair<std::string, cv::Mat>> aov_images = {
+            {"_depth", aovs.depth}, {"_layer", aovs.front_layer}, {"_coverage", aovs.coverage}};
+        for (auto & aov : aov_images)
+        {
+            if (settings.out_res_x > 0 && settings.out_res_y > 0)
+                cv::resize(aov.second, aov.second, cv::Size(settings.out_res_x, settings.out_res_y), 0, 0, cv::INTER_NEAREST);
+            output_paths.push_back(suffixed_path(output_image_path, aov.first));
+            output_images.push_back(aov.second);
+        }
+    }
+
+    perf_end(settings, megapixels);
+
+    // Save the results, the outputs are encoded in parallel
+    perf_begin(settings, "encode");
+    if (settings.raw_output != RawOutputMode::NONE)
+    {
+        #pragma omp parallel for
+        for (int k = 0; k < output_images.size(); ++k)
+        {
+            if (k == 0 && raw_result && raw_result->image.data == output_images[0].data)
+                raw_result->publish();
+            else
+                write_raw_image(output_paths[k], settings.raw_output, output_images[k]);
+        }
+    }
+    else if (settings.async_io)
+    {
+        std::vector<std::vector<uint8_t>> encoded(output_images.size());
+        #pragma omp parallel for
+        for (int k = 0; k < output_images.size(); ++k)
+        {
+            cv::imencode(file_extension(output_paths[k]), output_images[k], encoded[k]);
+        }
+
+        std::vector<std::future<void>> writes;
+        for (size_t k = 0; k < output_images.size(); ++k)
+            writes.push_back(settings.async_io->write_file(output_paths[k], std::move(encoded[k])));
+        for (auto & write : writes)
+            write.get();
+    }
+    else
+    {
+        #pragma omp parallel for
+        for (int k = 0; k < output_images.size(); ++k)
+        {
+            cv::imwrite(output_paths[k], output_images[k]);
+        }
+    }
+
+    perf_end(settings, megapixels);
 
     // Print timing
-    duration = (get_time() - t1).count() / 1000.0;
+    auto duration = (get_time() - t1).count() / 1000.0;
     std::cout << "Image saved! Elapsed time: " << duration << std::endl;
 
+    if (settings.buffer_pool)
+        std::cout << "Buffers reused: " << settings.buffer_pool->reused_count()
+                  << " allocated: " << settings.buffer_pool->allocated_count() << std::endl;
+
+    return true;
+}
+
+// Reads the next frame of the manifest, a manifest error is printed and ends the reading
+bool
+read_frame(ManifestReader & manifest, FrameEntry & frame, bool & failed)
+{
+    try
+    {
+        return manifest.next_frame(frame);
+    }
+    catch (const std::exception & error)
+    {
+        std::cout << error.what() << std::endl;
+        failed = true;
+        return false;
+    }
+}
+
+// Runs a step on the dependency record of a frame, its error fails the run
+bool
+record_step(const std::function<void()> & step)
+{
+    try
+    {
+        step();
+        return true;
+    }
+    catch (const std::exception & error)
+    {
+        std::cout << "Dependency record error! " << error.what() << std::endl;
+        return false;
+    }
+}
+
+int main(int argc, char** argv)
+{
+
+    // Positional arguments come first, named options ("--name value") may follow.
+    std::vector<std::string> arguments;
+    std::map<std::string, std::string> options;
+    for (int k = 1; k < argc; ++k)
+    {
+        auto argument = std::string(argv[k]);
+        if (argument.substr(0, 2) == "--")
+        {
+            bool has_value = (k + 1 < argc) && (std::string(argv[k + 1]).substr(0, 2) != "--");
+            options[argument.substr(2)] = has_value ? std::string(argv[++k]) : "";
+        }
+        else
+            arguments.push_back(argument);
+    }
+
+    // A worker of a sharded merge, started by the coordinator
+    if (options.count("shard-worker"))
+        return run_shard_worker();
+
+    // Differential validation of the merge kernels on generated layers
+    if (options.count("validate-kernels"))
+    {
+        auto values = split_ints(options["validate-kernels"].empty() ? "256x256" : options["validate-kernels"], 'x');
+        if (values.size() != 2 || values[0] <= 0 || values[1] <= 0)
+        {
+            std::cout << "Input parameters error! Use --validate-kernels [WxH]." << std::endl;
+            return 1;
+        }
+        return validate_kernels(cv::Size(values[0], values[1])) ? 0 : 1;
+    }
+
+    if (arguments.size() < 4)
+    {
+        std::cout << "Input parameters error! Use json name path, png output file path, zpass inversion mode and zpass extension flag as parameters." << std::endl;
+        std::cout << "Optional: output resolution x y, --roi x,y,width,height, --progressive [start step]," << std::endl;
+        std::cout << "--pyramid levels, --sizes WxH,WxH,..., --half, --async-io, --direct-io," << std::endl;
+        std::cout << "--buffer-pool [huge], --compress-layers, --aovs, --premultiplied [output], --perf-counters," << std::endl;
+        std::cout << "--max-memory size[K|M|G], --scratch-dir path, --reuse-tiles, --raw-output [file|shm], --incremental [hash]," << std::endl;
+        std::cout << "--expand-radius R, --preflight, --no-preflight," << std::endl;
+        std::cout << "or --validate-kernels [WxH] alone to check the merge kernels against the reference." << std::endl;
+        std::cout << "--shards N, --shard-transport pipe|shm, --shard-launchers \"ssh node1,ssh node2\"." << std::endl;
+        return 1;
+    }
+
+    MergeSettings settings;
+    auto json_file_path = arguments[0];
+    auto output_image_path = arguments[1];
+    settings.invert_z = std::stoi(arguments[2]);
+    settings.expand_z = std::stoi(arguments[3]);
+
+    // Z-pass expansion by a (2R + 1) square instead of a pixel (optional), it implies the expansion
+    if (options.count("expand-radius"))
+    {
+        settings.expand_radius = options["expand-radius"].empty() ? 0 : std::stoi(options["expand-radius"]);
+        if (settings.expand_radius <= 0)
+        {
+            std::cout << "Input parameters error! Use --expand-radius R with R > 0." << std::endl;
+            return 1;
+        }
+        settings.expand_z = true;
+    }
+
+    // Get the output resolution (optional)
+    if (arguments.size() == 6)
+    {
+        settings.out_res_x = std::stoi(arguments[4]);
+        settings.out_res_y = std::stoi(arguments[5]);
+    }
+
+    // Get the region of interest (optional), only this part is read and merged
+    if (options.count("roi"))
+    {
+        auto values = split_ints(options["roi"]);
+        if (values.size() != 4 || values[2] <= 0 || values[3] <= 0)
+        {
+            std::cout << "Input parameters error! Use --roi x,y,width,height." << std::endl;
+            return 1;
+        }
+        settings.roi = cv::Rect(values[0], values[1], values[2], values[3]);
+    }
+
+    // Coarse-to-fine previews (optional)
+    if (options.count("progressive"))
+        settings.progressive_step = options["progressive"].empty() ? 8 : std::stoi(options["progressive"]);
+
+    // Get the extra output resolutions (optional), all of them come from a single merge
+    settings.pyramid_levels = options.count("pyramid") ? std::stoi(options["pyramid"]) : 0;
+    if (options.count("sizes"))
+    {
+        for (auto & item : split(options["sizes"]))
+        {
+            auto values = split_ints(item, 'x');
+            if (values.size() != 2 || values[0] <= 0 || values[1] <= 0)
+            {
+                std::cout << "Input parameters error! Use --sizes WxH,WxH,..." << std::endl;
+                return 1;
+            }
+            settings.output_sizes.push_back(cv::Size(values[0], values[1]));
+        }
+    }
+
+    // Half precision layers and merge accumulator (optional)
+    settings.storage = options.count("half") ? PixelStorage::HALF : PixelStorage::NATIVE;
+
+    // Premultiplied alpha blending (optional), "output" keeps the result premultiplied
+    settings.premultiplied = options.count("premultiplied");
+    settings.premultiplied_output = (options["premultiplied"] == "output");
+
+    // Compressed in-memory layers (optional)
+    settings.compress_layers = options.count("compress-layers");
+
+    // Raw outputs in memory mapped files or POSIX shared memory (optional), named
+    // after the output file names
+    if (options.count("raw-output"))
+    {
+        if (options["raw-output"] == "shm")
+            settings.raw_output = RawOutputMode::SHARED_MEMORY;
+        else if (options["raw-output"].empty() || options["raw-output"] == "file")
+            settings.raw_output = RawOutputMode::FILE;
+        else
+        {
+            std::cout << "Input parameters error! Use --raw-output [file|shm]." << std::endl;
+            return 1;
+        }
+    }
+
+    // Depth, front layer and coverage outputs (optional)
+    settings.aovs = options.count("aovs");
+
+    // Asynchronous file I/O (optional)
+    bool direct_io = options.count("direct-io");
+    std::unique_ptr<AsyncIO> async_io;
+    if (options.count("async-io") || direct_io)
+    {
+        async_io.reset(new AsyncIO(direct_io));
+        settings.async_io = async_io.get();
+    }
+
+    // Sharded merge in worker processes (optional)
+    std::unique_ptr<ShardTransport> shard_transport;
+    settings.shards = options.count("shards") ? std::stoi(options["shards"]) : 0;
+    if (settings.shards > 0)
+    {
+        if (settings.progressive_step > 0 || settings.aovs)
+        {
+            std::cout << "Input parameters error! --progressive and --aovs can't be used with --shards." << std::endl;
+            return 1;
+        }
+
+        // The workers run this executable, remote nodes need it at the same path
+        char executable[4096] = {};
+        if (readlink("/proc/self/exe", executable, sizeof(executable) - 1) <= 0)
+        {
+            std::cout << "Can't locate the zmerger executable for the shard workers!" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> worker_command = {executable, "--shard-worker"};
+
+        if (options["shard-transport"] == "shm")
+        {
+            if (options.count("shard-launchers"))
+            {
+                std::cout << "Input parameters error! Shared memory workers can't be launched on other nodes." << std::endl;
+                return 1;
+            }
+            shard_transport.reset(new SharedMemoryTransport(worker_command));
+        }
+        else
+            shard_transport.reset(new PipeTransport(worker_command, split(options["shard-launchers"])));
+        settings.shard_transport = shard_transport.get();
+    }
+
+    // Memory budget of the loading (optional), the layers are spilled to the scratch directory if needed
+    std::unique_ptr<MemoryBudget> memory_budget;
+    if (options.count("max-memory"))
+    {
+        auto budget = parse_memory_size(options["max-memory"]);
+        if (budget == 0)
+        {
+            std::cout << "Input parameters error! Use --max-memory size[K|M|G]." << std::endl;
+            return 1;
+        }
+        memory_budget.reset(new MemoryBudget(budget));
+        settings.memory_budget = memory_budget.get();
+    }
+    settings.scratch_dir = options.count("scratch-dir") ? options["scratch-dir"] : "/tmp";
+
+    // Recycle the image buffers across frames (optional). The pool is never freed,
+    // OpenCV may still release buffers allocated from it at exit. The buffers it
+    // keeps aren't counted by the memory budget, they take at most half of it.
+    if (options.count("buffer-pool"))
+    {
+        size_t max_cached_bytes = memory_budget ? memory_budget->budget() / 2 : BUFFER_POOL_MAX_CACHED_BYTES;
+        settings.buffer_pool = new BufferPool(options["buffer-pool"] == "huge", max_cached_bytes);
+        cv::Mat::setDefaultAllocator(settings.buffer_pool);
+    }
+
+    // Temporal tile reuse across the frames of a sequence (optional)
+    TileReuse tile_reuse;
+    if (options.count("reuse-tiles"))
+    {
+        if (settings.shards > 0 || settings.progressive_step > 0)
+        {
+            std::cout << "Input parameters error! --reuse-tiles can't be used with --shards or --progressive." << std::endl;
+            return 1;
+        }
+        settings.tile_reuse = &tile_reuse;
+    }
+
+    // Hardware counters per stage (optional), in sharded mode only the coordinator is counted
+    std::unique_ptr<PerfCounters> perf_counters;
+    if (options.count("perf-counters"))
+    {
+        perf_counters.reset(new PerfCounters());
+        if (perf_counters->available())
+            settings.perf_counters = perf_counters.get();
+        else
+            std::cout << "Warning! Hardware counters are not available (see perf_event_paranoid), ignoring --perf-counters..." << std::endl;
+    }
+
+    // Incremental run (optional), the frames whose dependency record still matches
+    // are skipped. "hash" compares the layer contents instead of their mtimes.
+    bool incremental = options.count("incremental");
+    auto dependency_check = (options["incremental"] == "hash") ? DependencyCheck::HASH : DependencyCheck::MTIME;
+    if (incremental && settings.raw_output == RawOutputMode::SHARED_MEMORY)
+    {
+        std::cout << "Input parameters error! --incremental can't be used with --raw-output shm." << std::endl;
+        return 1;
+    }
+
+    // The parameters the merged pixels depend on
+    json11::Json::array output_sizes;
+    for (auto & size : settings.output_sizes)
+        output_sizes.push_back(json11::Json::array{size.width, size.height});
+    json11::Json parameters = json11::Json::object{
+        {"invert_z", settings.invert_z},
+        {"expand_z", settings.expand_z},
+        {"expand_radius", settings.expand_radius},
+        {"out_res", json11::Json::array{settings.out_res_x, settings.out_res_y}},
+        {"roi", json11::Json::array{settings.roi.x, settings.roi.y, settings.roi.width, settings.roi.height}},
+        {"progressive", settings.progressive_step},
+        {"pyramid", settings.pyramid_levels},
+        {"sizes", output_sizes},
+        {"half", settings.storage == PixelStorage::HALF},
+        {"premultiplied", settings.premultiplied},
+        {"premultiplied_output", settings.premultiplied_output},
+        {"aovs", settings.aovs},
+        {"raw_output", settings.raw_output != RawOutputMode::NONE}};
+
+    // Starting global time tracking
+    auto start_time = get_time();
+
+    // Every frame is checked from its image headers before its layers are decoded
+    // (unless --no-preflight). With --preflight the whole manifest is checked
+    // first, a bad file fails the run before any frame is merged.
+    settings.preflight = !options.count("no-preflight");
+    if (options.count("preflight") && !settings.preflight)
+    {
+        std::cout << "Input parameters error! --preflight can't be used with --no-preflight." << std::endl;
+        return 1;
+    }
+    if (options.count("preflight"))
+    {
+        auto manifest_plan = plan_manifest(json_file_path, output_image_path, settings.roi, settings.storage);
+        if (manifest_plan.error_count > 0)
+        {
+            for (auto & error : manifest_plan.errors)
+                std::cout << error << std::endl;
+            if (manifest_plan.error_count > manifest_plan.errors.size())
+                std::cout << "... and " << manifest_plan.error_count - manifest_plan.errors.size() << " more errors." << std::endl;
+            std::cout << "Pre-flight failed! Nothing was merged." << std::endl;
+            return 1;
+        }
+
+        auto duration = (get_time() - start_time).count() / 1000.0;
+        std::cout << "Pre-flight done: " << manifest_plan.frames << " frames, " << manifest_plan.layers
+                  << " layers. Elapsed time: " << duration << std::endl;
+        std::cout << "Memory plan: up to " << manifest_plan.max_steady / 1048576.0 << " MB of layers and merge buffers per frame, "
+                  << manifest_plan.max_decode / 1048576.0 << " MB more per layer being decoded" << std::endl;
+    }
+
+    // The manifest is read frame by frame while merging
+    ManifestReader manifest(json_file_path, output_image_path);
+    FrameEntry frame;
+    int frames_count = 0;
+    int frames_skipped = 0;
+    bool manifest_failed = false;
+    while (read_frame(manifest, frame, manifest_failed))
+    {
+        if (frame.layers.empty())
+        {
+            std::cout << "Warning! No input images found for " << frame.output_file_path << ", skipping..." << std::endl;
+            continue;
+        }
+
+        ++frames_count;
+        json11::Json record;
+        if (incremental)
+        {
+            bool up_to_date = false;
+            auto check = [&]()
+            {
+                record = frame_record(frame, parameters, dependency_check);
+                up_to_date = frame_up_to_date(frame, record);
+            };
+            if (!record_step(check))
+                return 1;
+            if (up_to_date)
+            {
+                std::cout << frame.output_file_path << " is up to date, skipping..." << std::endl;
+                ++frames_skipped;
+                continue;
+            }
+
+            // A merge interrupted from here on must not leave the old record matching
+            if (!record_step([&]() { remove_frame_record(frame); }))
+                return 1;
+        }
+
+        // The stale frames are merged one at a time like the others, each one with
+        // all the threads, so the run keeps its one-frame memory profile
+        std::vector<std::string> output_paths;
+        if (!merge_frame(frame, settings, output_paths))
+            return 1;
+        if (incremental && !record_step([&]() { write_frame_record(frame, record, output_paths); }))
+            return 1;
+    }
+    if (manifest_failed)
+        return 1;
+
+    if (frames_count == 0)
+    {
+        std::cout << "Warning! No input images found, aborting..." << std::endl;
+        return 1;
+    }
+
     // Print global timing
-    duration = (get_time() - start_time).count() / 1000.0;
+    auto duration = (get_time() - start_time).count() / 1000.0;
     std::cout << "Processing done! Cumulative elapsed time: " << duration << std::endl;
+    if (incremental)
+        std::cout << "Frames merged: " << frames_count - frames_skipped << ", up to date: " << frames_skipped << std::endl;
+
+    if (settings.tile_reuse)
+    {
+        size_t tiles = tile_reuse.tiles_reused + tile_reuse.tiles_merged;
+        std::cout << "Tile reuse rate: " << (tiles ? 100.0 * tile_reuse.tiles_reused / tiles : 0.0) << "% ("
+                  << tile_reuse.tiles_reused << " of " << tiles << " tiles)" << std::endl;
+    }
+
+    if (settings.perf_counters)
+        settings.perf_counters->report();
 }